@@ -0,0 +1,40 @@
+#!/bin/sh
+# Name: eeprom.sh
+# Prints the debounce settings block (debounce_config_t in main.c) as the
+# comma separated bytes avrdude takes for an immediate write.
+# Usage: eeprom.sh MODE PRESS RELEASE [PRESS RELEASE ...]
+# MODE is the DEBOUNCE_EAGER_* / DEBOUNCE_ADAPTIVE flags, followed by the
+# press and release cycles of each entry of buttons[] in order.
+
+if [ $# -lt 3 ] || [ $(( ($# - 1) % 2 )) -ne 0 ]; then
+    echo "usage: $0 MODE PRESS RELEASE [PRESS RELEASE ...]" >&2
+    exit 1
+fi
+
+crc=0
+out=""
+
+# CRC-8 Dallas/iButton, the same as _crc_ibutton_update() in avr-libc.
+emit() {
+    byte=$(( $1 & 0xff ))
+    crc=$(( crc ^ byte ))
+    i=0
+    while [ $i -lt 8 ]; do
+        if [ $(( crc & 1 )) -ne 0 ]; then
+            crc=$(( (crc >> 1) ^ 0x8c ))
+        else
+            crc=$(( crc >> 1 ))
+        fi
+        i=$(( i + 1 ))
+    done
+    out="$out$(printf '0x%02x' $byte),"
+}
+
+emit 0xdb                   # DEBOUNCE_CONFIG_MAGIC
+emit $1                     # mode
+shift
+emit $(( $# / 2 ))          # numButtons
+for cycles in "$@"; do
+    emit $cycles
+done
+printf '%s0x%02x\n' "$out" $crc
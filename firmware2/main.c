@@ -8,60 +8,210 @@
 #include <avr/io.h>
 #include <avr/wdt.h>
 #include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include <util/atomic.h>
+#include <util/twi.h>
 #include <string.h>
+#include <stddef.h>
 
-#define CREATE_BUTTON(port, pin, key) \
+#define CREATE_BUTTON(player, port, pin, key, pad) \
     { \
         port, \
         (1 << pin), \
-        FALSE, \
-        RELEASED_CYCLES, \
         key, \
-        0 \
+        pad, \
+        player \
     }
 
-button_t buttons[] = {
+const PROGMEM button_t buttons[] = {
     
-    CREATE_BUTTON(PORT_A, 0, KEY_1),        //brown     p1 start
+    CREATE_BUTTON(PLAYER_1, PORT_A, 0, KEY_1, PAD_BUTTON(7)),         //brown     p1 start
 
-    CREATE_BUTTON(PORT_A, 6, MOD_LCTRL),    //purple    p1 A
-    CREATE_BUTTON(PORT_A, 4, MOD_LSHIFT),   //green     p1 B
-    CREATE_BUTTON(PORT_A, 2, MOD_LALT),     //orange    p1 C
-    CREATE_BUTTON(PORT_A, 5, KEY_Z),        //blue      p1 1
-    CREATE_BUTTON(PORT_A, 3, KEY_X),        //yellow    p1 2
-    CREATE_BUTTON(PORT_A, 1, KEY_C),        //red       p1 3
+    CREATE_BUTTON(PLAYER_1, PORT_A, 6, MOD_LCTRL, PAD_BUTTON(1)),     //purple    p1 A
+    CREATE_BUTTON(PLAYER_1, PORT_A, 4, MOD_LSHIFT, PAD_BUTTON(2)),    //green     p1 B
+    CREATE_BUTTON(PLAYER_1, PORT_A, 2, MOD_LALT, PAD_BUTTON(3)),      //orange    p1 C
+    CREATE_BUTTON(PLAYER_1, PORT_A, 5, KEY_Z, PAD_BUTTON(4)),         //blue      p1 1
+    CREATE_BUTTON(PLAYER_1, PORT_A, 3, KEY_X, PAD_BUTTON(5)),         //yellow    p1 2
+    CREATE_BUTTON(PLAYER_1, PORT_A, 1, KEY_C, PAD_BUTTON(6)),         //red       p1 3
 
-    CREATE_BUTTON(PORT_D, 1, KEY_W),        //black     p1 up
-    CREATE_BUTTON(PORT_C, 7, KEY_S),        //brown     p1 down
-    CREATE_BUTTON(PORT_D, 3, KEY_A),        //red       p1 left
-    CREATE_BUTTON(PORT_D, 4, KEY_D),        //orange    p1 right
+    CREATE_BUTTON(PLAYER_1, PORT_D, 1, KEY_W, PAD_UP),                //black     p1 up
+    CREATE_BUTTON(PLAYER_1, PORT_C, 7, KEY_S, PAD_DOWN),              //brown     p1 down
+    CREATE_BUTTON(PLAYER_1, PORT_D, 3, KEY_A, PAD_LEFT),              //red       p1 left
+    CREATE_BUTTON(PLAYER_1, PORT_D, 4, KEY_D, PAD_RIGHT),             //orange    p1 right
 
-    CREATE_BUTTON(PORT_D, 0, KEY_Q),        //white     quit
+    CREATE_BUTTON(PLAYER_1, PORT_D, 0, KEY_Q, PAD_BUTTON(8)),         //white     quit
     /*
-    CREATE_BUTTON(PORT_B, P2_UP, KEY_U),
-    CREATE_BUTTON(PORT_B, P2_DOWN, KEY_J),
-    CREATE_BUTTON(PORT_B, P2_LEFT, KEY_H),
-    CREATE_BUTTON(PORT_B, P2_RIGHT, KEY_K),
+    CREATE_BUTTON(PLAYER_2, PORT_B, P2_UP, KEY_U, PAD_UP),
+    CREATE_BUTTON(PLAYER_2, PORT_B, P2_DOWN, KEY_J, PAD_DOWN),
+    CREATE_BUTTON(PLAYER_2, PORT_B, P2_LEFT, KEY_H, PAD_LEFT),
+    CREATE_BUTTON(PLAYER_2, PORT_B, P2_RIGHT, KEY_K, PAD_RIGHT),
     
-    CREATE_BUTTON(PORT_A, P2_START, KEY_2),
+    CREATE_BUTTON(PLAYER_2, PORT_A, P2_START, KEY_2, PAD_BUTTON(7)),
     
-    CREATE_BUTTON(PORT_C, P2_A, MOD_RCTRL),
-    CREATE_BUTTON(PORT_C, P2_B, MOD_RSHIFT),
-    CREATE_BUTTON(PORT_C, P2_C, MOD_RALT),
-    CREATE_BUTTON(PORT_C, P2_D, KEY_B),
-    CREATE_BUTTON(PORT_C, P2_E, KEY_N),
-    CREATE_BUTTON(PORT_C, P2_F, KEY_M),
+    CREATE_BUTTON(PLAYER_2, PORT_C, P2_A, MOD_RCTRL, PAD_BUTTON(1)),
+    CREATE_BUTTON(PLAYER_2, PORT_C, P2_B, MOD_RSHIFT, PAD_BUTTON(2)),
+    CREATE_BUTTON(PLAYER_2, PORT_C, P2_C, MOD_RALT, PAD_BUTTON(3)),
+    CREATE_BUTTON(PLAYER_2, PORT_C, P2_D, KEY_B, PAD_BUTTON(4)),
+    CREATE_BUTTON(PLAYER_2, PORT_C, P2_E, KEY_N, PAD_BUTTON(5)),
+    CREATE_BUTTON(PLAYER_2, PORT_C, P2_F, KEY_M, PAD_BUTTON(6)),
     */
 };
 
 #define NUM_BUTTONS (sizeof(buttons) / sizeof(buttons[0]))
-#define SIMUL_BUTTONS 7
-#define REPORT_COUNT (SIMUL_BUTTONS + 1)
 
-const PROGMEM char usbHidReportDescriptor[37] = {
+// copies an entry of buttons[] out of flash.
+static void readButton(uint8_t iButton, button_t* button) {
+    memcpy_P(button, &buttons[iButton], sizeof(button_t));
+}
+
+/* With a mouse or analog axes every report needs an ID, given as the first
+   byte of the report. The button reports then have one byte more. */
+#if MOUSE_AXES || ANALOG_AXES
+#define REPORT_ID_BYTES 1
+#define REPORT_ID_BUTTONS 1
+#define REPORT_ID_EVENTS 2
+#define REPORT_ID_MOUSE 3
+#define REPORT_ID_ANALOG 4
+#define REPORT_ID(id) 0x85, id,    /*   REPORT_ID */
+#else
+#define REPORT_ID_BYTES 0
+#define REPORT_ID(id)
+#endif
+
+/* Vendor feature report carrying the player's event_log_t, appended to
+   every report descriptor. */
+#if EVENT_LOG_SIZE
+#define EVENT_FEATURE \
+    REPORT_ID(REPORT_ID_EVENTS) \
+    0x06, 0x00, 0xff,              /*   USAGE_PAGE (Vendor Defined Page 1) */ \
+    0x09, 0x01,                    /*   USAGE (Vendor Usage 1) */ \
+    0x15, 0x00,                    /*   LOGICAL_MINIMUM (0) */ \
+    0x26, 0xff, 0x00,              /*   LOGICAL_MAXIMUM (255) */ \
+    0x75, 0x08,                    /*   REPORT_SIZE (8) */ \
+    0x95, sizeof(event_log_t) - 1, /*   REPORT_COUNT */ \
+    0xb1, 0x02,                    /*   FEATURE (Data,Var,Abs) */
+#else
+#define EVENT_FEATURE
+#endif
+
+#if MOUSE_AXES
+#if MOUSE_AXES > 2
+#error "the mouse report has an X and a Y axis only"
+#endif
+
+/* Relative mouse for the encoders, appended to every report descriptor.
+   Its buttons are always released, the buttons of a trackball are read as
+   ordinary buttons. */
+#define MOUSE_REPORT_COUNT (REPORT_ID_BYTES + 1 + MOUSE_AXES)
+
+#define MOUSE_COLLECTION \
+    0x05, 0x01,                    /* USAGE_PAGE (Generic Desktop) */ \
+    0x09, 0x02,                    /* USAGE (Mouse) */ \
+    0xa1, 0x01,                    /* COLLECTION (Application) */ \
+    REPORT_ID(REPORT_ID_MOUSE) \
+    0x09, 0x01,                    /*   USAGE (Pointer) */ \
+    0xa1, 0x00,                    /*   COLLECTION (Physical) */ \
+    0x05, 0x09,                    /*     USAGE_PAGE (Button) */ \
+    0x19, 0x01,                    /*     USAGE_MINIMUM (Button 1) */ \
+    0x29, 0x03,                    /*     USAGE_MAXIMUM (Button 3) */ \
+    0x15, 0x00,                    /*     LOGICAL_MINIMUM (0) */ \
+    0x25, 0x01,                    /*     LOGICAL_MAXIMUM (1) */ \
+    0x75, 0x01,                    /*     REPORT_SIZE (1) */ \
+    0x95, 0x03,                    /*     REPORT_COUNT (3) */ \
+    0x81, 0x02,                    /*     INPUT (Data,Var,Abs) */ \
+    0x75, 0x05,                    /*     REPORT_SIZE (5) */ \
+    0x95, 0x01,                    /*     REPORT_COUNT (1) */ \
+    0x81, 0x03,                    /*     INPUT (Cnst,Var,Abs) */ \
+    0x05, 0x01,                    /*     USAGE_PAGE (Generic Desktop) */ \
+    0x09, 0x30,                    /*     USAGE (X) */ \
+    0x09, 0x31,                    /*     USAGE (Y) */ \
+    0x15, 0x81,                    /*     LOGICAL_MINIMUM (-127) */ \
+    0x25, 0x7f,                    /*     LOGICAL_MAXIMUM (127) */ \
+    0x35, 0x00,                    /*     PHYSICAL_MINIMUM (0) */ \
+    0x45, 0x00,                    /*     PHYSICAL_MAXIMUM (0) */ \
+    0x75, 0x08,                    /*     REPORT_SIZE (8) */ \
+    0x95, MOUSE_AXES,              /*     REPORT_COUNT */ \
+    0x81, 0x06,                    /*     INPUT (Data,Var,Rel) */ \
+    0xc0,                          /*   END_COLLECTION */ \
+    0xc0,                          /* END_COLLECTION */
+#else
+#define MOUSE_COLLECTION
+#endif
+
+#if ANALOG_AXES
+#if ANALOG_AXES > 3
+#error "the analog report has room for 3 axes"
+#endif
+#if ANALOG_FIRST_CHANNEL + ANALOG_AXES > 8
+#error "the ADC has 8 single ended channels"
+#endif
+
+/* Absolute axes for the ADC channels, X, Y and Z in order, appended to
+   every report descriptor after the mouse. */
+#define ANALOG_MAX ((1 << (10 + ANALOG_EXTRA_BITS)) - 1)
+#define ANALOG_REPORT_COUNT (REPORT_ID_BYTES + 2 * ANALOG_AXES)
+
+#define ANALOG_COLLECTION \
+    0x05, 0x01,                    /* USAGE_PAGE (Generic Desktop) */ \
+    0x09, 0x04,                    /* USAGE (Joystick) */ \
+    0xa1, 0x01,                    /* COLLECTION (Application) */ \
+    REPORT_ID(REPORT_ID_ANALOG) \
+    0x19, 0x30,                    /*   USAGE_MINIMUM (X) */ \
+    0x29, 0x30 + ANALOG_AXES - 1,  /*   USAGE_MAXIMUM */ \
+    0x15, 0x00,                    /*   LOGICAL_MINIMUM (0) */ \
+    0x26, ANALOG_MAX & 0xff, ANALOG_MAX >> 8, /* LOGICAL_MAXIMUM */ \
+    0x35, 0x00,                    /*   PHYSICAL_MINIMUM (0) */ \
+    0x45, 0x00,                    /*   PHYSICAL_MAXIMUM (0) */ \
+    0x75, 0x10,                    /*   REPORT_SIZE (16) */ \
+    0x95, ANALOG_AXES,             /*   REPORT_COUNT */ \
+    0x81, 0x02,                    /*   INPUT (Data,Var,Abs) */ \
+    0xc0,                          /* END_COLLECTION */
+#else
+#define ANALOG_COLLECTION
+#endif
+
+#if KEYBOARD_NKRO
+/* One bit per key from KEY_A to KEY_6, which covers the keys of both
+   players. Keys outside the range are not reported in this mode. */
+#define NKRO_FIRST_KEY KEY_A
+#define NKRO_KEY_BYTES 4
+#define NKRO_LAST_KEY (NKRO_FIRST_KEY + NKRO_KEY_BYTES * 8 - 1)
+#define KEYBOARD_REPORT_COUNT (REPORT_ID_BYTES + NKRO_KEY_BYTES + 1)
+
+const PROGMEM char keyboardReportDescriptor[] = {
     0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
     0x09, 0x06,                    // USAGE (Keyboard)
     0xa1, 0x01,                    // COLLECTION (Application)
+    REPORT_ID(REPORT_ID_BUTTONS)
+    0x05, 0x07,                    //   USAGE_PAGE (Keyboard)
+
+    0x19, 0xe0,                    //   USAGE_MINIMUM (Keyboard LeftControl)
+    0x29, 0xe7,                    //   USAGE_MAXIMUM (Keyboard Right GUI)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x25, 0x01,                    //   LOGICAL_MAXIMUM (1)
+    0x75, 0x01,                    //   REPORT_SIZE (1)
+    0x95, 0x08,                    //   REPORT_COUNT (8)
+    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+
+    0x19, NKRO_FIRST_KEY,          //   USAGE_MINIMUM
+    0x29, NKRO_LAST_KEY,           //   USAGE_MAXIMUM
+    0x95, NKRO_KEY_BYTES * 8,      //   REPORT_COUNT
+    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+    EVENT_FEATURE
+    0xc0,                           // END_COLLECTION
+    MOUSE_COLLECTION
+    ANALOG_COLLECTION
+};
+#else
+#define SIMUL_BUTTONS (7 - REPORT_ID_BYTES)
+#define KEYBOARD_REPORT_COUNT (REPORT_ID_BYTES + SIMUL_BUTTONS + 1)
+
+const PROGMEM char keyboardReportDescriptor[] = {
+    0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
+    0x09, 0x06,                    // USAGE (Keyboard)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    REPORT_ID(REPORT_ID_BUTTONS)
     0x05, 0x07,                    //   USAGE_PAGE (Keyboard)
 
     0x19, 0xe0,                    //   USAGE_MINIMUM (Keyboard LeftControl)
@@ -79,114 +229,1380 @@ const PROGMEM char usbHidReportDescriptor[37] = {
     0x19, 0x00,                    //   USAGE_MINIMUM (Reserved (no event indicated))
     0x29, 0x65,                    //   USAGE_MAXIMUM (Keyboard Application)
     0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
+    EVENT_FEATURE
     0xc0,                           // END_COLLECTION
+    MOUSE_COLLECTION
+    ANALOG_COLLECTION
 };
+#endif
+
+/* Gamepad report: buttons 1-16 in the first two bytes, then the hat switch
+   in the low nibble of the third. Directions are collected as PAD_UP..
+   PAD_RIGHT bits in GAMEPAD_HAT and turned into a hat value at the end. */
+#define GAMEPAD_REPORT_COUNT (REPORT_ID_BYTES + 3)
+#define GAMEPAD_HAT (REPORT_ID_BYTES + 2)
+
+#if KEYBOARD_REPORT_COUNT > REPORT_MAX_COUNT || GAMEPAD_REPORT_COUNT > REPORT_MAX_COUNT
+#error "REPORT_MAX_COUNT is too small for the reports"
+#endif
+
+const PROGMEM char gamepadReportDescriptor[] = {
+    0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
+    0x09, 0x05,                    // USAGE (Game Pad)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    REPORT_ID(REPORT_ID_BUTTONS)
+    0x05, 0x09,                    //   USAGE_PAGE (Button)
+    0x19, 0x01,                    //   USAGE_MINIMUM (Button 1)
+    0x29, 0x10,                    //   USAGE_MAXIMUM (Button 16)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x25, 0x01,                    //   LOGICAL_MAXIMUM (1)
+    0x75, 0x01,                    //   REPORT_SIZE (1)
+    0x95, 0x10,                    //   REPORT_COUNT (16)
+    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+
+    0x05, 0x01,                    //   USAGE_PAGE (Generic Desktop)
+    0x09, 0x39,                    //   USAGE (Hat switch)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x25, 0x07,                    //   LOGICAL_MAXIMUM (7)
+    0x35, 0x00,                    //   PHYSICAL_MINIMUM (0)
+    0x46, 0x3b, 0x01,              //   PHYSICAL_MAXIMUM (315)
+    0x65, 0x14,                    //   UNIT (Eng Rot:Angular Pos)
+    0x75, 0x04,                    //   REPORT_SIZE (4)
+    0x95, 0x01,                    //   REPORT_COUNT (1)
+    0x81, 0x42,                    //   INPUT (Data,Var,Abs,Null)
+    0x65, 0x00,                    //   UNIT (None)
+    0x81, 0x03,                    //   INPUT (Cnst,Var,Abs)
+    EVENT_FEATURE
+    0xc0,                           // END_COLLECTION
+    MOUSE_COLLECTION
+    ANALOG_COLLECTION
+};
+
+// hat value for each combination of direction bits, opposite directions cancel out.
+static const PROGMEM uint8_t hatDirections[16] = {
+    8, 0, 4, 8,     // none, up, down, up+down
+    6, 7, 5, 6,     // left, +up, +down, +up+down
+    2, 1, 3, 2,     // right, +up, +down, +up+down
+    8, 0, 4, 8,     // left+right, +up, +down, +up+down
+};
+
+#if !USB_CFG_HAVE_INTRIN_ENDPOINT3
+#error "each player needs its own interrupt endpoint, enable USB_CFG_HAVE_INTRIN_ENDPOINT3"
+#endif
+
+#define HID_INTERFACE_LENGTH (9 + 9 + 7)
+#define CONFIG_DESCRIPTOR_LENGTH (9 + NUM_PLAYERS * HID_INTERFACE_LENGTH)
+
+// offset of a player's HID descriptor in the configuration descriptor.
+#define HID_DESCRIPTOR_OFFSET(player) (9 + (player) * HID_INTERFACE_LENGTH + 9)
+
+// interface, HID and interrupt-in endpoint descriptors for one player.
+#define HID_INTERFACE(number, endpoint, reportDescriptorLength) \
+    9, USBDESCR_INTERFACE, number, 0, \
+    1,              /* number of endpoints */ \
+    USB_CFG_INTERFACE_CLASS, \
+    USB_CFG_INTERFACE_SUBCLASS, \
+    USB_CFG_INTERFACE_PROTOCOL, \
+    0,              /* interface string index */ \
+    9, USBDESCR_HID, 0x01, 0x01, \
+    0x00,           /* country code */ \
+    0x01,           /* number of class descriptors */ \
+    USBDESCR_HID_REPORT, reportDescriptorLength, 0, \
+    7, USBDESCR_ENDPOINT, (char)(0x80 | (endpoint)), \
+    0x03,           /* interrupt endpoint */ \
+    8, 0,           /* maximum packet size */ \
+    USB_CFG_INTR_POLL_INTERVAL
+
+/* Composite configuration with one HID interface per player, so each
+   player has its own interrupt endpoint, report and rollover. Only the
+   length of the report descriptor differs between the report modes. */
+#define CONFIG_DESCRIPTOR(reportDescriptorLength) { \
+    9, USBDESCR_CONFIG, CONFIG_DESCRIPTOR_LENGTH, 0, \
+    NUM_PLAYERS,    /* number of interfaces */ \
+    1,              /* index of this configuration */ \
+    0,              /* configuration name string index */ \
+    (1 << 7),       /* attributes: bus powered */ \
+    USB_CFG_MAX_BUS_POWER / 2, \
+    HID_INTERFACE(PLAYER_1, 1, reportDescriptorLength), \
+    HID_INTERFACE(PLAYER_2, USB_CFG_EP3_NUMBER, reportDescriptorLength), \
+}
+
+const PROGMEM char keyboardConfigDescriptor[] =
+    CONFIG_DESCRIPTOR(sizeof(keyboardReportDescriptor));
+const PROGMEM char gamepadConfigDescriptor[] =
+    CONFIG_DESCRIPTOR(sizeof(gamepadReportDescriptor));
+
+static report_mode_t reportMode = REPORT_KEYBOARD;
+static uint8_t reportCount = KEYBOARD_REPORT_COUNT;
+
+usbMsgLen_t usbFunctionDescriptor(struct usbRequest* rq) {
+    const char* config = keyboardConfigDescriptor;
+    const char* report = keyboardReportDescriptor;
+    uint8_t reportLength = sizeof(keyboardReportDescriptor);
+    uint8_t player = rq->wIndex.bytes[0];
+
+    if (reportMode == REPORT_GAMEPAD) {
+        config = gamepadConfigDescriptor;
+        report = gamepadReportDescriptor;
+        reportLength = sizeof(gamepadReportDescriptor);
+    }
+
+    switch (rq->wValue.bytes[1]) {
+        case USBDESCR_CONFIG:
+            usbMsgPtr = (usbMsgPtr_t)config;
+            return CONFIG_DESCRIPTOR_LENGTH;
+        case USBDESCR_HID:
+            if (player >= NUM_PLAYERS) {
+                return 0;
+            }
+            usbMsgPtr = (usbMsgPtr_t)(config + HID_DESCRIPTOR_OFFSET(player));
+            return 9;
+        case USBDESCR_HID_REPORT:
+            usbMsgPtr = (usbMsgPtr_t)report;
+            return reportLength;
+        default:
+            return 0;
+    }
+}
+
+/* One HID interface per player. Its queue is a ring of report buffers:
+   reports are built in the slot at tail (the back buffer) and published by
+   advancing tail, a single byte write, so every reader sees a complete
+   report. Published reports are sent one per interrupt poll, so a tap that
+   is pressed and released between two polls still shows up in one report.
+   The slot before tail always holds the newest report, whether it has been
+   sent or not, and is what GET_REPORT and idle repeats use. */
+static hid_interface_t interfaces[NUM_PLAYERS];
+#if EVENT_LOG_SIZE
+static event_log_t eventLogs[NUM_PLAYERS];
+#endif
+#if ANALOG_AXES
+static uint8_t analogReport[ANALOG_REPORT_COUNT] = { REPORT_ID_ANALOG }; // axes last sent
+#endif
+
+// report type in the high byte of wValue for GET_REPORT.
+#define HID_REPORT_FEATURE 3
+
+static void buildReport(player_t player, uint8_t* report);
+
+#define QUEUED_REPORT(iface, n) (iface)->queue[(uint8_t)(n) & (REPORT_QUEUE_SIZE - 1)]
+
+/* Rebuilds a player's report after a change and publishes it if it differs
+   from the newest one. While the queue is full the change stays pending
+   and later changes merge into it, so the host always ends up with the
+   current state. */
+static void publishReport(player_t player) {
+    hid_interface_t* iface = &interfaces[player];
+    uint8_t* back;
+
+    // the back buffer must be neither pending nor the newest report.
+    if (!iface->stale
+        || (uint8_t)(iface->tail - iface->head) >= REPORT_QUEUE_SIZE - 1) {
+        return;
+    }
+    iface->stale = FALSE;
+
+    back = QUEUED_REPORT(iface, iface->tail);
+    buildReport(player, back);
+    if (memcmp(back, QUEUED_REPORT(iface, iface->tail - 1), reportCount) != 0) {
+        iface->tail++;
+    }
+}
+
+uint8_t usbFunctionSetup(uint8_t data[8]) {
+	usbRequest_t *rq = (void *)data;
+	hid_interface_t *iface;
+
+	if ((rq->bmRequestType & USBRQ_TYPE_MASK) != USBRQ_TYPE_CLASS)
+		return 0;
+	if (rq->wIndex.bytes[0] >= NUM_PLAYERS)
+		return 0;
+	iface = &interfaces[rq->wIndex.bytes[0]];
+
+	switch (rq->bRequest) {
+		case USBRQ_HID_GET_IDLE:
+			usbMsgPtr = (usbMsgPtr_t)&iface->idleRate;
+			return 1;
+		case USBRQ_HID_SET_IDLE:
+			iface->idleRate = rq->wValue.bytes[1];
+			iface->idleTicks = 0;
+			return 0;
+		case USBRQ_HID_GET_REPORT:
+#if EVENT_LOG_SIZE
+			if (rq->wValue.bytes[1] == HID_REPORT_FEATURE) {
+				event_log_t* log = &eventLogs[rq->wIndex.bytes[0]];
+				log->pollFrame = iface->nextPoll - iface->pollFrames;
+				usbMsgPtr = (usbMsgPtr_t)&log->reportId + 1 - REPORT_ID_BYTES;
+				return sizeof(event_log_t) - 1 + REPORT_ID_BYTES;
+			}
+#endif
+#if MOUSE_AXES
+			if (rq->wValue.bytes[0] == REPORT_ID_MOUSE) {
+				// motion is only ever sent once, so polling it gives no movement.
+				static uint8_t mouseIdle[MOUSE_REPORT_COUNT] = { REPORT_ID_MOUSE };
+				usbMsgPtr = (usbMsgPtr_t)mouseIdle;
+				return MOUSE_REPORT_COUNT;
+			}
+#endif
+#if ANALOG_AXES
+			if (rq->wValue.bytes[0] == REPORT_ID_ANALOG) {
+				usbMsgPtr = (usbMsgPtr_t)analogReport;
+				return ANALOG_REPORT_COUNT;
+			}
+#endif
+	        usbMsgPtr = (usbMsgPtr_t)QUEUED_REPORT(iface, iface->tail - 1);
+			return reportCount;
+		default:
+			return 0;
+	}
+}
+
+#if DEPRESSED_CYCLES > DEBOUNCE_MAX_CYCLES || RELEASED_CYCLES > DEBOUNCE_MAX_CYCLES
+#error "debounce cycles do not fit in DEBOUNCE_COUNTER_BITS"
+#endif
+
+static debounce_t debouncePorts[NUM_PORTS];
+#if DEBOUNCE_MODE & DEBOUNCE_ADAPTIVE
+static uint8_t pinButtons[NUM_PORTS][8]; // index into buttons[] for each pin
+static bounce_t bounces[NUM_BUTTONS];
+#endif
+uint8_t debounceMode = DEBOUNCE_MODE;
+
+/* Debounce settings kept in EEPROM so each cabinet can be tuned to its
+   switches without reflashing. The block is ignored unless the magic, the
+   button count and the CRC-8 (Dallas/iButton) over all preceding bytes
+   match, in which case the DEPRESSED_CYCLES and RELEASED_CYCLES defaults
+   stay. The windows only live in the ports' bit planes.
+   The block is the only EEMEM data, so it starts at EEPROM address 0:
+     0         magic, DEBOUNCE_CONFIG_MAGIC
+     1         mode, DEBOUNCE_EAGER_* flags (DEBOUNCE_ADAPTIVE only if built in)
+     2         numButtons, the number of entries in buttons[]
+     3 + 2*i   press cycles of buttons[i], 1..DEBOUNCE_MAX_CYCLES
+     4 + 2*i   release cycles of buttons[i]
+     last      CRC-8, reflected polynomial 0x8c, initial value 0
+   "make eeprom" writes it with eeprom.sh from EEPROM_MODE and EEPROM_CYCLES,
+   and the EESAVE fuse keeps it over the chip erase of "make flash". */
+#define DEBOUNCE_CONFIG_MAGIC 0xdb
+
+typedef struct {
+    uint8_t magic;
+    uint8_t mode;       // DEBOUNCE_EAGER_* flags
+    uint8_t numButtons;
+    uint8_t cycles[NUM_BUTTONS][2]; // press, release per entry in buttons[]
+    uint8_t crc;
+} debounce_config_t;
+
+static debounce_config_t EEMEM eepromConfig;
+
+// writes a cycle count for the given pins into the bit planes of a vertical counter.
+static void setCyclePlanes(uint8_t* planes, uint8_t pin, uint8_t cycles) {
+    uint8_t k;
+    for (k = 0; k < DEBOUNCE_COUNTER_BITS; k++) {
+        if (cycles & (1 << k)) {
+            planes[k] |= pin;
+        } else {
+            planes[k] &= ~pin;
+        }
+    }
+}
+
+// reads a pin's cycle count back from the bit planes of a vertical counter.
+static uint8_t getCyclePlanes(const uint8_t* planes, uint8_t pin) {
+    uint8_t cycles = 0;
+    uint8_t k;
+    for (k = 0; k < DEBOUNCE_COUNTER_BITS; k++) {
+        if (planes[k] & pin) {
+            cycles |= (1 << k);
+        }
+    }
+    return cycles;
+}
+
+static uint8_t clampCycles(uint8_t cycles) {
+    if (cycles < 1) {
+        return 1;
+    }
+    if (cycles > DEBOUNCE_MAX_CYCLES) {
+        return DEBOUNCE_MAX_CYCLES;
+    }
+    return cycles;
+}
+
+static void loadDebounceConfig(void) {
+    debounce_config_t config;
+    uint8_t* bytes = (uint8_t*)&config;
+    uint8_t crc = 0;
+    uint8_t i;
+
+    eeprom_read_block(&config, &eepromConfig, sizeof(config));
+    for (i = 0; i < offsetof(debounce_config_t, crc); i++) {
+        crc = _crc_ibutton_update(crc, bytes[i]);
+    }
+    if (config.magic != DEBOUNCE_CONFIG_MAGIC
+        || config.numButtons != NUM_BUTTONS
+        || config.crc != crc) {
+        return;
+    }
+
+    debounceMode = config.mode
+        & (DEBOUNCE_EAGER_PRESS | DEBOUNCE_EAGER_RELEASE | (DEBOUNCE_MODE & DEBOUNCE_ADAPTIVE));
+    for (i = 0; i < NUM_BUTTONS; i++) {
+        button_t button;
+        debounce_t* port;
+
+        readButton(i, &button);
+        port = &debouncePorts[button.port];
+        setCyclePlanes(port->pressCycles, button.pin, clampCycles(config.cycles[i][0]));
+        setCyclePlanes(port->releaseCycles, button.pin, clampCycles(config.cycles[i][1]));
+    }
+}
+
+/* Debounces the eight pins of one port at once, raw has a bit set for each
+   pin that currently reads as pressed. A pin whose raw state differs from
+   its debounced state counts down, any other pin has its counter reloaded
+   with the window for its current state. Pins selected by eagerPress or
+   eagerRelease change on the first differing sample instead and are then
+   locked for the window of that change. Returns the pins that changed. */
+static uint8_t debouncePort(debounce_t* port, uint8_t raw,
+        uint8_t eagerPress, uint8_t eagerRelease) {
+    uint8_t delta = (raw & port->mask) ^ port->state;
+    uint8_t eager = (port->state & eagerRelease) | (~port->state & eagerPress);
+    uint8_t instant = delta & eager & ~port->locked;
+    uint8_t active = (delta & ~instant) | port->locked;
+    uint8_t borrow = active;
+    uint8_t running = 0;
+    uint8_t expired;
+    uint8_t toggle;
+    uint8_t reload;
+    uint8_t windowState;
+    uint8_t k;
+
+    for (k = 0; k < DEBOUNCE_COUNTER_BITS; k++) {
+        uint8_t cycles = port->cycles[k];
+        port->cycles[k] = cycles ^ borrow;
+        borrow &= ~cycles;
+        running |= port->cycles[k];
+    }
+
+    expired = active & ~running;
+    toggle = (expired & ~port->locked) | instant;
+    port->state ^= toggle;
+    port->locked = (port->locked & ~expired) | instant;
+
+    // a lockout lasts for the window of the change that started it.
+    reload = ~active | expired;
+    windowState = port->state ^ instant;
+    for (k = 0; k < DEBOUNCE_COUNTER_BITS; k++) {
+        uint8_t window = (windowState & port->releaseCycles[k])
+            | (~windowState & port->pressCycles[k]);
+        port->cycles[k] = (port->cycles[k] & ~reload) | (window & reload);
+    }
+    return toggle;
+}
+
+#if DEBOUNCE_MODE & DEBOUNCE_ADAPTIVE
+// edges that never lead to a change are over once they stop for longer than any window.
+#define BOUNCE_QUIET_CYCLES (DEBOUNCE_MAX_CYCLES + 1)
+
+static void setBounceWindow(debounce_t* port, uint8_t pin, bounce_t* bounce, bool_t pressed) {
+    uint8_t window = bounce->worstBounce[pressed] + ADAPT_MARGIN;
+
+    if (window < ADAPT_MIN_CYCLES) {
+        window = ADAPT_MIN_CYCLES;
+    }
+    window = clampCycles(window);
+
+    if (pressed) {
+        setCyclePlanes(port->pressCycles, pin, window);
+    } else {
+        setCyclePlanes(port->releaseCycles, pin, window);
+    }
+}
+
+/* Records how long a finished bounce lasted, from its first edge to its
+   last. The bounce is attributed to the level the pin settled at. */
+static void recordBounce(debounce_t* port, uint8_t pin, bounce_t* bounce, bool_t pressed) {
+    uint8_t length = bounce->bounceLast;
+
+    if (length >= bounce->worstBounce[pressed]) {
+        bounce->worstBounce[pressed] = length;
+        bounce->quietCount[pressed] = 0;
+    } else if (++bounce->quietCount[pressed] >= ADAPT_DECAY_EPISODES) {
+        bounce->worstBounce[pressed]--;
+        bounce->quietCount[pressed] = 0;
+    }
+    setBounceWindow(port, pin, bounce, pressed);
+}
+
+/* Times the raw edges of each transition, given the pins debouncePort()
+   toggled in this scan. A transition is over once it has been decided and
+   the debouncer has settled on it, out of any lockout and with raw agreeing
+   with the state, so its counter reloads. Nothing after that counts as
+   bounce, and the hold of a quick tap is never taken for one. Only pins
+   that are bouncing are visited, so a quiet port costs a couple of
+   instructions per scan. */
+static void trackBounce(port_t iPort, uint8_t raw, uint8_t toggled) {
+    debounce_t* port = &debouncePorts[iPort];
+    uint8_t edges;
+    uint8_t settled;
+    uint8_t visit;
+    uint8_t pin;
+    uint8_t bit;
+
+    raw &= port->mask;
+    edges = raw ^ port->raw;
+    port->raw = raw;
+    settled = ~(raw ^ port->state) & ~port->locked;
+    visit = port->bouncing | edges | toggled;
+
+    for (bit = 0, pin = 1; visit; bit++, pin <<= 1) {
+        bounce_t* bounce;
+
+        if (!(visit & pin)) {
+            continue;
+        }
+        visit &= ~pin;
+        bounce = &bounces[pinButtons[iPort][bit]];
+
+        // a change out of an eager lockout ends the transition it locked out.
+        if (port->bouncing & port->decided & toggled & pin) {
+            port->bouncing &= ~pin;
+            recordBounce(port, pin, bounce, !(port->state & pin));
+        }
+        if (!(port->bouncing & pin)) {
+            // an eager change or a fast button has already decided it.
+            port->bouncing |= pin;
+            port->decided = (port->decided & ~pin) | (~(raw ^ port->state) & pin);
+            bounce->bounceAge = 0;
+            bounce->bounceLast = 0;
+        } else {
+            if (bounce->bounceAge < 0xff) {
+                bounce->bounceAge++;
+            }
+            if (edges & pin) {
+                bounce->bounceLast = bounce->bounceAge;
+            }
+            port->decided |= toggled & pin;
+        }
+
+        if (((settled & pin) && ((port->decided & pin)
+                || bounce->bounceAge - bounce->bounceLast > BOUNCE_QUIET_CYCLES))
+            || bounce->bounceAge == 0xff) {
+            port->bouncing &= ~pin;
+            recordBounce(port, pin, bounce, (port->state & pin) != 0);
+        }
+    }
+}
+#endif
+
+/* Finds the report byte and bit of a button of buttons[] in the current
+   mode. Returns 0 for a key that is sent as a keycode instead, and for a
+   button the mode has no place for. */
+static uint8_t reportBit(const button_t* button, uint8_t* index) {
+    uint8_t key = pgm_read_byte(&button->key);
+    uint8_t pad = pgm_read_byte(&button->pad);
+
+    *index = REPORT_ID_BYTES;
+    if (reportMode == REPORT_GAMEPAD) {
+        if (pad < PAD_UP) {
+            *index = REPORT_ID_BYTES + pad / 8;
+            return 1 << (pad % 8);
+        }
+        if (pad <= PAD_RIGHT) {
+            *index = GAMEPAD_HAT;
+            return 1 << (pad - PAD_UP);
+        }
+        return 0;
+    }
+    if (key >= MOD_LCTRL && key <= MOD_RGUI) {
+        return 1 << (key - MOD_LCTRL);
+    }
+#if KEYBOARD_NKRO
+    if (key >= NKRO_FIRST_KEY && key <= NKRO_LAST_KEY) {
+        *index = REPORT_ID_BYTES + 1 + (key - NKRO_FIRST_KEY) / 8;
+        return 1 << ((key - NKRO_FIRST_KEY) % 8);
+    }
+#endif
+    return 0;
+}
+
+// builds a player's report for the current debounced state of the buttons.
+static void buildReport(player_t player, uint8_t* report) {
+    int iButton;
+#if !KEYBOARD_NKRO
+    int iReport = REPORT_ID_BYTES;
+#endif
+
+    memset(report, 0, reportCount);
+#if REPORT_ID_BYTES
+    report[0] = REPORT_ID_BUTTONS;
+#endif
+
+    for (iButton = 0; iButton < NUM_BUTTONS; iButton++) {
+
+        const button_t* button = &buttons[iButton];
+        uint8_t index;
+        uint8_t mask;
+
+        // the flash table is read field by field, most buttons are released.
+        if (!(debouncePorts[pgm_read_byte(&button->port)].state & pgm_read_byte(&button->pin))
+            || pgm_read_byte(&button->player) != player) {
+            continue;
+        }
+        mask = reportBit(button, &index);
+        if (mask != 0) {
+            report[index] |= mask;
+        }
+#if !KEYBOARD_NKRO
+        else if (reportMode == REPORT_KEYBOARD && iReport < REPORT_ID_BYTES + SIMUL_BUTTONS) {
+            report[++iReport] = pgm_read_byte(&button->key);
+        }
+#endif
+    }
+
+    if (reportMode == REPORT_GAMEPAD) {
+        report[GAMEPAD_HAT] = pgm_read_byte(&hatDirections[report[GAMEPAD_HAT]]);
+    }
+}
+
+static uint8_t sampleTail;
+// samples lost because the main loop fell more than a ring behind.
+uint8_t sampleOverruns;
+
+#if MATRIX_ROWS
+static uint8_t matrixRows[MATRIX_ROWS]; // last scan without ghosts, a set bit means pressed
+uint16_t matrixGhosts;                  // scans dropped as ambiguous
+
+/* Takes a matrix scan unless two rows with several keys down share two
+   pressed columns. Then one of the four corners may be a ghost, so the
+   last clean scan is kept until the pattern goes away. */
+static void filterGhosts(const uint8_t* sample) {
+    uint8_t pressed[MATRIX_ROWS];
+    uint8_t multiple = 0;
+    uint8_t changed = 0;
+    uint8_t i;
+    uint8_t j;
+
+    for (i = 0; i < MATRIX_ROWS; i++) {
+        pressed[i] = ~sample[i];
+        changed |= pressed[i] ^ matrixRows[i];
+        if (pressed[i] & (pressed[i] - 1)) {
+            multiple |= (1 << i);
+        }
+    }
+    if (!changed) {
+        return;
+    }
+
+    for (i = 0; multiple; i++) {
+        if (!(multiple & (1 << i))) {
+            continue;
+        }
+        multiple &= ~(1 << i);
+        for (j = i + 1; j < MATRIX_ROWS; j++) {
+            uint8_t common = pressed[i] & pressed[j];
+            if ((multiple & (1 << j)) && (common & (common - 1))) {
+                matrixGhosts++;
+                return;
+            }
+        }
+    }
+    memcpy(matrixRows, pressed, MATRIX_ROWS);
+}
+#endif
+
+#if MOUSE_AXES
+/* Quadrature decoding. Each axis' A/B pair in a sample is looked up with
+   the pair from the sample before: one Gray code step either way counts,
+   no change or both bits flipping count nothing. */
+#define QUAD_MASK ((1 << (2 * MOUSE_AXES)) - 1)
+
+static const PROGMEM int8_t quadSteps[16] = {
+     0,  1, -1,  0,
+    -1,  0,  0,  1,
+     1,  0,  0, -1,
+     0, -1,  1,  0
+};
+
+static uint8_t quadState = 0xff;        // A/B pairs of the last sample, none yet
+static int16_t mouseCounts[MOUSE_AXES]; // steps not reported yet
+#define MOUSE_COUNT_LIMIT 0x7f00          // steps beyond are dropped while the host doesn't poll
+// steps lost because an encoder moved twice between two samples.
+uint16_t quadSkips;
+
+static void decodeQuadrature(uint8_t pins) {
+    uint8_t state = (pins >> QUAD_FIRST_PIN) & QUAD_MASK;
+    uint8_t axis;
+
+    if (state == quadState) {
+        return;
+    }
+    if (quadState <= QUAD_MASK) {
+        for (axis = 0; axis < MOUSE_AXES; axis++) {
+            uint8_t from = (quadState >> (2 * axis)) & 3;
+            uint8_t to = (state >> (2 * axis)) & 3;
+            int8_t step = (int8_t)pgm_read_byte(&quadSteps[(from << 2) | to]);
+
+            if ((from ^ to) == 3) {
+                quadSkips++;
+            }
+            if (step > 0 ? mouseCounts[axis] < MOUSE_COUNT_LIMIT : mouseCounts[axis] > -MOUSE_COUNT_LIMIT) {
+                mouseCounts[axis] += step;
+            }
+        }
+    }
+    quadState = state;
+}
+
+static uint8_t mouseReport[MOUSE_REPORT_COUNT] = { REPORT_ID_MOUSE };
+
+// moves as many of the counted steps as a report can carry into mouseReport.
+static bool_t takeMouseMotion(void) {
+    bool_t moved = FALSE;
+    uint8_t axis;
+
+    for (axis = 0; axis < MOUSE_AXES; axis++) {
+        int16_t steps = mouseCounts[axis];
+
+        if (steps > 127) {
+            steps = 127;
+        } else if (steps < -127) {
+            steps = -127;
+        }
+        mouseCounts[axis] -= steps;
+        mouseReport[REPORT_ID_BYTES + 1 + axis] = steps;
+        moved |= steps != 0;
+    }
+    return moved;
+}
+#endif
+
+#if DEBOUNCE_DECIMATE & (DEBOUNCE_DECIMATE - 1)
+#error "DEBOUNCE_DECIMATE must be a power of two"
+#endif
+
+#define SAMPLE_TICKS (F_CPU / SAMPLE_RATE)
+#define DEBOUNCE_US (1000000 / DEBOUNCE_RATE)
+
+static uint8_t debounceTick;    // counts the debounced samples
+
+#if EVENT_LOG_SIZE
+static uint16_t frameOffset(uint32_t ticks, uint8_t* frame);
+
+// finds the entry of buttons[] on a pin, only when a change is logged.
+static uint8_t findButton(port_t iPort, uint8_t pin) {
+    uint8_t iButton;
+
+    for (iButton = 0; iButton < NUM_BUTTONS - 1; iButton++) {
+        if (pgm_read_byte(&buttons[iButton].port) == iPort
+            && pgm_read_byte(&buttons[iButton].pin) == pin) {
+            break;
+        }
+    }
+    return iButton;
+}
+
+// logs a change decided at the given clock reading, edgeUs after its first raw edge.
+static void logEvent(uint8_t iButton, bool_t pressed, uint32_t ticks, uint16_t edgeUs) {
+    event_log_t* log = &eventLogs[pgm_read_byte(&buttons[iButton].player)];
+    input_event_t* event = &log->events[log->count % EVENT_LOG_SIZE];
+
+    event->button = iButton | (pressed ? 0x80 : 0);
+    event->decisionUs = frameOffset(ticks, &event->frame) / CLOCK_TICKS_PER_US;
+    event->edgeUs = edgeUs;
+    log->count++;
+}
+
+/* Remembers the tick of the first raw edge of every change and logs an
+   event once the change is decided in the given sample. An edge that dies
+   out is dropped once raw agrees with the state again, out of any lockout,
+   and the edge is older than the window a change would have taken, so a
+   bounce after a decision can't date the next change. */
+static void trackEdges(port_t iPort, uint8_t raw, uint8_t toggled, uint8_t sample) {
+    debounce_t* port = &debouncePorts[iPort];
+    uint8_t delta = (raw & port->mask) ^ port->state;
+    uint8_t start = (delta ^ toggled) & ~port->edgePending;
+    uint8_t settled;
+    uint8_t bit;
+    uint8_t pin;
+
+    port->edgePending |= start;
+    settled = port->edgePending & ~delta & ~toggled & ~port->locked;
+
+    for (bit = 0, pin = 1; start | toggled | settled; bit++, pin <<= 1) {
+        if (start & pin) {
+            port->edgeTick[bit] = debounceTick;
+        }
+        if (toggled & pin) {
+            uint8_t age = sampleHead - sample;
+            logEvent(findButton(iPort, pin), (port->state & pin) != 0,
+                    clockTicks() - (uint32_t)age * SAMPLE_TICKS,
+                    (uint8_t)(debounceTick - port->edgeTick[bit]) * DEBOUNCE_US);
+            port->edgePending &= ~pin;
+        } else if (settled & pin) {
+            uint8_t window = getCyclePlanes(
+                (port->state & pin) ? port->releaseCycles : port->pressCycles, pin);
+
+            if ((uint8_t)(debounceTick - port->edgeTick[bit]) > window) {
+                port->edgePending &= ~pin;
+            }
+        }
+        start &= ~pin;
+        toggled &= ~pin;
+        settled &= ~pin;
+    }
+}
+#endif
+
+/* Debounces every DEBOUNCE_DECIMATE-th sample taken since the last call,
+   encoders still see all of them. Returns TRUE if any button changed
+   state. */
+bool_t debounceButtons(void) {
+    uint8_t head = sampleHead;
+    uint8_t pending = head - sampleTail;
+    uint8_t eagerPress = (debounceMode & DEBOUNCE_EAGER_PRESS) ? 0xff : 0;
+    uint8_t eagerRelease = (debounceMode & DEBOUNCE_EAGER_RELEASE) ? 0xff : 0;
+    uint8_t changed = 0;
+    int8_t iPort;
+
+    if (pending > SAMPLE_RING_SIZE) {
+        sampleOverruns += pending - SAMPLE_RING_SIZE;
+        sampleTail = head - SAMPLE_RING_SIZE;
+    }
+
+    for (; sampleTail != head; sampleTail++) {
+        uint8_t* sample = sampleRing[sampleTail & (SAMPLE_RING_SIZE - 1)];
+#if EXTRA_BYTES
+        uint8_t* extra;
+#endif
+
+#if MOUSE_AXES
+        decodeQuadrature(sample[QUAD_PORT]);
+#endif
+        if (sampleTail & (DEBOUNCE_DECIMATE - 1)) {
+            continue;
+        }
+        debounceTick++;
+#if EXTRA_BYTES
+        extra = extraRing[(sampleTail / DEBOUNCE_DECIMATE) & (EXTRA_RING_SIZE - 1)];
+#endif
+#if MATRIX_ROWS
+        filterGhosts(extra + PORT_MATRIX(0) - NUM_NATIVE_PORTS);
+#endif
+        for (iPort = 0; iPort < NUM_PORTS; iPort++) {
+            debounce_t* port = &debouncePorts[iPort];
+            uint8_t raw;
+            uint8_t toggled;
+
+            if (port->mask == 0) {
+                continue;
+            }
+#if EXTRA_BYTES
+            raw = ~(iPort < NUM_NATIVE_PORTS ? sample[iPort] : extra[iPort - NUM_NATIVE_PORTS]);
+#else
+            raw = ~sample[iPort];
+#endif
+#if MATRIX_ROWS
+            if (iPort >= PORT_MATRIX(0) && iPort < PORT_MATRIX(MATRIX_ROWS)) {
+                raw = matrixRows[iPort - PORT_MATRIX(0)];
+            }
+#endif
+#if LINK_BYTES
+            if (iPort >= PORT_LINK(0)) {
+                // secondaries send levels they have debounced already.
+                toggled = (raw & port->mask) ^ port->state;
+                port->state ^= toggled;
+            } else {
+                toggled = debouncePort(port, raw, eagerPress, eagerRelease);
+            }
+#else
+            toggled = debouncePort(port, raw, eagerPress, eagerRelease);
+#endif
+#if EVENT_LOG_SIZE
+            if (toggled | port->edgePending | ((raw & port->mask) ^ port->state)) {
+                trackEdges(iPort, raw, toggled, sampleTail);
+            }
+#endif
+            changed |= toggled;
+#if DEBOUNCE_MODE & DEBOUNCE_ADAPTIVE
+            if ((debounceMode & DEBOUNCE_ADAPTIVE) && iPort < PORT_LINK(0)) {
+                trackBounce(iPort, raw, toggled);
+            }
+#endif
+        }
+    }
+
+    return changed != 0;
+}
+
+#if CHAIN_BYTES
+/* Latches the chain's inputs and shifts them in over SPI at F_CPU / 2,
+   16 cycles per register. The bus belongs to the sample interrupt once
+   sampling has started. */
+static inline void readChain(uint8_t* bytes) {
+    uint8_t n;
+
+    PORTB &= ~CHAIN_LOAD;
+    PORTB |= CHAIN_LOAD;
+    for (n = 0; n < CHAIN_BYTES; n++) {
+        SPDR = 0;
+        while (!(SPSR & (1 << SPIF))) {
+        }
+        bytes[n] = SPDR;
+    }
+}
+
+static void initChain(void) {
+    PORTB |= CHAIN_LOAD;
+    DDRB |= CHAIN_LOAD | (1 << PB7); // SS and SCK, MISO stays an input
+    SPCR = (1 << SPE) | (1 << MSTR); // mode 0, QH is valid before the first clock
+    SPSR = (1 << SPI2X);
+}
+#endif
+
+#if MATRIX_ROWS
+#if MATRIX_ROWS > 8
+#error "the matrix rows must be on one port"
+#endif
+#if EXPANDER && (MATRIX_COLS & 0x03)
+#error "matrix columns PC0/PC1 are the expander's TWI pins"
+#endif
+#if CHAIN_BYTES && MATRIX_ROWS > 4
+#error "matrix rows above PB3 are the chain's SPI pins"
+#endif
+#if (EXPANDER || FAST_BUTTON_INT2 >= 0) && MATRIX_ROWS > 2
+#error "matrix row PB2 is INT2, taken by the expander or a fast button"
+#endif
+#if MOUSE_AXES && QUAD_FIRST_PIN < MATRIX_ROWS
+#error "matrix rows PB0.. overlap the encoder pins from QUAD_FIRST_PIN"
+#endif
+
+/* Pulls each row low in turn and reads all columns at once. Idle rows
+   float, so two keys in one column never short two driven rows. */
+static inline void scanMatrix(uint8_t* rows) {
+    uint8_t row;
+    uint8_t pin;
+
+    for (row = 0, pin = 1; row < MATRIX_ROWS; row++, pin <<= 1) {
+        MATRIX_ROW_DDR |= pin;
+        _delay_us(MATRIX_SETTLE_US);
+        rows[row] = MATRIX_COL_PIN | (uint8_t)~MATRIX_COLS;
+        MATRIX_ROW_DDR &= ~pin;
+    }
+}
+
+static void initMatrix(void) {
+    MATRIX_COL_PORT |= MATRIX_COLS; // the row port's outputs stay low, its DDR selects the row
+}
+#endif
+
+#if EXPANDER
+#if FAST_BUTTON_INT2 >= 0
+#error "the expander's interrupt line needs INT2, set FAST_BUTTON_INT2 to -1"
+#endif
+
+// MCP23017 registers with IOCON.BANK = 0, each A register is followed by its B register.
+#define MCP_GPINTEN 0x04
+#define MCP_IOCON   0x0a
+#define MCP_GPPU    0x0c
+#define MCP_GPIO    0x12
+#define MCP_IOCON_MIRROR (1 << 6)
+#define MCP_IOCON_ODR    (1 << 2)
+
+#define TWI_BIT_RATE 333333  // the fastest rate TWBR >= 10 allows at 12MHz
+#define TWI_BITRATE_REGISTER ((F_CPU / TWI_BIT_RATE - 16) / 2)
+#define TWI_GO ((1 << TWINT) | (1 << TWEN))
+
+#if TWI_BITRATE_REGISTER < 10
+#error "TWBR below 10 is out of spec for a TWI master, lower TWI_BIT_RATE"
+#endif
+
+static volatile uint8_t expanderPins[2];    // last read of GPA and GPB
+static volatile bool_t expanderChanged;     // INTA has fallen since the last read
+uint8_t expanderErrors;                     // reads that were not acknowledged
+
+/* Steps of an expander read. The TWI interrupt can't be used, TWINT keeps
+   it pending so it can't be made nestable, and a handler that blocks other
+   interrupts would hold off USB for too long. stepExpander() is called
+   from the main loop instead and never waits for the bus. */
+typedef enum {
+    TWI_IDLE,
+    TWI_START,
+    TWI_WRITE_ADDRESS,
+    TWI_WRITE_REGISTER,
+    TWI_RESTART,
+    TWI_READ_ADDRESS,
+    TWI_READ_A,
+    TWI_READ_B
+} twi_state_t;
+
+static twi_state_t twiState = TWI_IDLE;
+
+static void stepExpander(void) {
+    uint8_t status;
+
+    if (twiState == TWI_IDLE) {
+        // a START written while the last STOP is still on the bus would be lost
+        if (expanderChanged && !(TWCR & (1 << TWSTO))) {
+            expanderChanged = FALSE;
+            TWCR = TWI_GO | (1 << TWSTA);
+            twiState = TWI_START;
+        }
+        return;
+    }
+    if (!(TWCR & (1 << TWINT))) {
+        return;
+    }
+
+    status = TW_STATUS;
+    switch (twiState) {
+        case TWI_START:
+        case TWI_RESTART:
+            if (status != TW_START && status != TW_REP_START) {
+                break;
+            }
+            TWDR = (EXPANDER_ADDRESS << 1) | (twiState == TWI_START ? TW_WRITE : TW_READ);
+            TWCR = TWI_GO;
+            twiState++;
+            return;
+        case TWI_WRITE_ADDRESS:
+            if (status != TW_MT_SLA_ACK) {
+                break;
+            }
+            TWDR = MCP_GPIO;
+            TWCR = TWI_GO;
+            twiState = TWI_WRITE_REGISTER;
+            return;
+        case TWI_WRITE_REGISTER:
+            if (status != TW_MT_DATA_ACK) {
+                break;
+            }
+            TWCR = TWI_GO | (1 << TWSTA);
+            twiState = TWI_RESTART;
+            return;
+        case TWI_READ_ADDRESS:
+            if (status != TW_MR_SLA_ACK) {
+                break;
+            }
+            TWCR = TWI_GO | (1 << TWEA);
+            twiState = TWI_READ_A;
+            return;
+        case TWI_READ_A:
+            if (status != TW_MR_DATA_ACK) {
+                break;
+            }
+            expanderPins[0] = TWDR;
+            TWCR = TWI_GO;  // no acknowledge, GPB is the last byte
+            twiState = TWI_READ_B;
+            return;
+        case TWI_READ_B:
+            if (status != TW_MR_DATA_NACK) {
+                break;
+            }
+            expanderPins[1] = TWDR;
+            TWCR = TWI_GO | (1 << TWSTO);
+            twiState = TWI_IDLE;
+            return;
+        default:
+            break;
+    }
+
+    // reading GPIO is what releases INTA, so a failed read is tried again while it is low.
+    expanderErrors++;
+    expanderChanged = !(PINB & (1 << PB2));
+    TWCR = TWI_GO | (1 << TWSTO);
+    twiState = TWI_IDLE;
+}
+
+// runs one bus operation to completion, only used before USB is up.
+static uint8_t twiWait(uint8_t control) {
+    uint16_t timeout = 0xffff;
+
+    TWCR = control;
+    while (!(TWCR & (1 << TWINT))) {
+        if (--timeout == 0) {
+            return 0;
+        }
+    }
+    return TW_STATUS;
+}
+
+// writes a value to both the A and the B register of a pair.
+static void writeExpander(uint8_t reg, uint8_t value) {
+    if (twiWait(TWI_GO | (1 << TWSTA)) == TW_START) {
+        TWDR = (EXPANDER_ADDRESS << 1) | TW_WRITE;
+        if (twiWait(TWI_GO) == TW_MT_SLA_ACK) {
+            TWDR = reg;
+            twiWait(TWI_GO);
+            TWDR = value;
+            twiWait(TWI_GO);
+            TWDR = value;
+            twiWait(TWI_GO);
+        }
+    }
+    TWCR = TWI_GO | (1 << TWSTO);
+    while (TWCR & (1 << TWSTO)) {
+    }
+}
+
+static void initExpander(void) {
+    uint16_t timeout = 0xffff;
+
+    TWSR = 0;
+    TWBR = TWI_BITRATE_REGISTER;
+    PORTB |= (1 << PB2);    // pull-up for the open-drain INTA
+    expanderPins[0] = 0xff;
+    expanderPins[1] = 0xff;
+
+    writeExpander(MCP_IOCON, MCP_IOCON_MIRROR | MCP_IOCON_ODR);
+    writeExpander(MCP_GPPU, 0xff);
+    writeExpander(MCP_GPINTEN, 0xff);
+
+    // read once to get the current state and release INTA.
+    expanderChanged = TRUE;
+    while ((expanderChanged || twiState != TWI_IDLE) && !expanderErrors && --timeout) {
+        stepExpander();
+    }
+
+    MCUCSR &= ~(1 << ISC2); // falling edge
+    GIFR = (1 << INTF2);
+    GICR |= (1 << INT2);
+    // INTA may have fallen while the flag was cleared, the level still shows it.
+    expanderChanged = !(PINB & (1 << PB2));
+}
+#endif
+
+#if LINK_ROLE
+#if F_CPU / 8 % LINK_BAUD
+#error "LINK_BAUD can't be made exactly from F_CPU"
+#endif
+#if LINK_BOARD_BYTES > 8 || LINK_TIMEOUT_FRAMES <= LINK_REFRESH_FRAMES
+#error "a frame holds 8 bytes, and a board must refresh before it times out"
+#endif
+#if LINK_ROLE == LINK_SECONDARY && (LINK_BOARD < 1 || LINK_BOARD > 15)
+#error "secondaries are numbered 1-15"
+#endif
+
+/* UART link between boards. The UART is polled from the sample interrupt,
+   which takes at most one byte in and one byte out per sample. At 125k
+   baud a byte takes longer than a sample, and the two byte receive buffer
+   covers a sample held off by USB, so no byte is lost. A receive interrupt
+   would not do, it stays pending until UDR is read and so can't re-enable
+   interrupts for USB first. */
+#define LINK_RING_SIZE 32   // must be a power of two
+#define LINK_SYNC 0xa5
+#define LINK_FRAME_MAX (3 + LINK_BOARD_BYTES + 1)
+
+#if LINK_ROLE == LINK_SECONDARY
+#define LINK_PINS ((1 << PD0) | (1 << PD1))
+#else
+#define LINK_PINS (1 << PD0)
+#endif
+
+static uint8_t linkRx[LINK_RING_SIZE];
+static volatile uint8_t linkRxHead;
+static uint8_t linkRxTail;
+static uint8_t linkTx[LINK_RING_SIZE];
+static uint8_t linkTxHead;
+static volatile uint8_t linkTxTail;
+static volatile bool_t linkBusy;        // a sample interrupt is polling the UART
+// bytes lost to a full ring or receive buffer, and forwarded frames dropped.
+uint16_t linkOverruns;
+
+#if LINK_BYTES
+static volatile uint8_t linkPins[LINK_BYTES];   // pin levels of the secondaries, low means pressed
+#endif
+
+/* Moves a byte between the UART and the rings. A nested sample interrupt
+   leaves it to the outer one, which could otherwise be between reading UDR
+   and advancing the head; the UART holds the byte until the next sample. */
+static inline void pollLink(void) {
+    if (linkBusy) {
+        return;
+    }
+    linkBusy = TRUE;
+    if (UCSRA & (1 << RXC)) {
+        if (UCSRA & (1 << DOR)) {
+            linkOverruns++;
+        }
+        if ((uint8_t)(linkRxHead - linkRxTail) >= LINK_RING_SIZE) {
+            (void)UDR;      // a full ring keeps its unread bytes
+            linkOverruns++;
+        } else {
+            linkRx[linkRxHead & (LINK_RING_SIZE - 1)] = UDR;
+            linkRxHead++;
+        }
+    }
+#if LINK_ROLE == LINK_SECONDARY
+    if ((UCSRA & (1 << UDRE)) && linkTxTail != linkTxHead) {
+        UDR = linkTx[linkTxTail & (LINK_RING_SIZE - 1)];
+        linkTxTail++;
+    }
+#endif
+    linkBusy = FALSE;
+}
 
-static uint8_t reportBuffer[REPORT_COUNT];
-static uint8_t idleRate = 1;
+void initLink(void) {
+#if LINK_BYTES
+    memset((void*)linkPins, 0xff, LINK_BYTES);
+#endif
+    PORTD |= (1 << PD0);    // an open RXD at the end of the chain stays idle
+    UBRRH = 0;
+    UBRRL = F_CPU / 8 / LINK_BAUD - 1;
+    UCSRA = (1 << U2X);
+    UCSRC = (1 << URSEL) | (1 << UCSZ1) | (1 << UCSZ0); // 8N1
+#if LINK_ROLE == LINK_SECONDARY
+    UCSRB = (1 << RXEN) | (1 << TXEN);
+#else
+    UCSRB = (1 << RXEN);
+#endif
+}
+#endif
 
-uint8_t usbFunctionSetup(uint8_t data[8]) {
-	usbRequest_t *rq = (void *)data;
+#if EXTRA_BYTES
+// reads the input bytes past the native ports, in port order.
+static inline void readExtraBytes(uint8_t* bytes) {
+#if CHAIN_BYTES
+    readChain(bytes);
+#endif
+#if MATRIX_ROWS
+    scanMatrix(bytes + PORT_MATRIX(0) - NUM_NATIVE_PORTS);
+#endif
+#if EXPANDER
+    bytes[PORT_EXPANDER(0) - NUM_NATIVE_PORTS] = expanderPins[0];
+    bytes[PORT_EXPANDER(1) - NUM_NATIVE_PORTS] = expanderPins[1];
+#endif
+#if LINK_BYTES
+    memcpy(bytes + PORT_LINK(0) - NUM_NATIVE_PORTS, (const void*)linkPins, LINK_BYTES);
+#endif
+}
 
-	if ((rq->bmRequestType & USBRQ_TYPE_MASK) != USBRQ_TYPE_CLASS)
-		return 0;
+// reads an input byte past the native ports, only before sampling starts.
+static uint8_t readExtraPort(port_t port) {
+    uint8_t bytes[EXTRA_BYTES];
 
-	switch (rq->bRequest) {
-		case USBRQ_HID_GET_IDLE:
-			usbMsgPtr = (usbMsgPtr_t)&idleRate;
-			return 1;
-		case USBRQ_HID_SET_IDLE:
-			idleRate = rq->wValue.bytes[1];
-			return 0;
-		case USBRQ_HID_GET_REPORT:
-	        usbMsgPtr = (usbMsgPtr_t)reportBuffer;
-			return sizeof(reportBuffer);
-		default:
-			return 0;
-	}
+    readExtraBytes(bytes);
+    return bytes[port - NUM_NATIVE_PORTS];
 }
+#endif
+
+static bool_t isButtonHeld(const button_t* button) {
+    uint8_t pins;
 
-static inline bool_t getButtonState(button_t* button) {
-    switch(button->port) {
+    switch (button->port) {
         case PORT_A:
-            return (PINA & button->pin) == 0;
+            pins = PINA;
+            break;
         case PORT_B:
-            return (PINB & button->pin) == 0;
+            pins = PINB;
+            break;
         case PORT_C:
-            return (PINC & button->pin) == 0;
+            pins = PINC;
+            break;
         case PORT_D:
-            return (PIND & button->pin) == 0;
+            pins = PIND;
+            break;
         default:
-            return FALSE;
+#if EXTRA_BYTES
+            pins = readExtraPort(button->port);
+#else
+            pins = 0xff;
+#endif
+            break;
     }
+    return (pins & button->pin) == 0;
 }
 
-static inline void resetCycles(button_t* button) {
-    if (button->debouncedState) {
-        button->cyclesRemaining = RELEASED_CYCLES;
-    } else {
-        button->cyclesRemaining = DEPRESSED_CYCLES;
+/* Presses on the external interrupt pins. The interrupts only note the
+   time of the first falling edge, the main loop takes the press from
+   there without waiting for a sample. */
+static int8_t fastButtons[2] = { FAST_BUTTON_INT1, FAST_BUTTON_INT2 };
+static volatile uint8_t fastEdges;          // bit n set for fastButtons[n]
+static volatile uint16_t fastEdgeTicks[2];  // low half of the clock at the edge
+
+// nestable, timer1 is read with interrupts off since its 16-bit registers share one TEMP byte.
+#define FAST_EDGE(n) \
+    if (!(fastEdges & (1 << (n)))) { \
+        ATOMIC_BLOCK(ATOMIC_FORCEON) { \
+            fastEdgeTicks[n] = TCNT1; \
+        } \
+        fastEdges |= (1 << (n)); \
     }
+
+ISR(INT1_vect, ISR_NOBLOCK) {
+    FAST_EDGE(0)
 }
 
-void debounceButtons(uint8_t* reportBuffer) {
-    int iButton;
-    int iReport = 0;
-    memset(reportBuffer, 0, REPORT_COUNT);
+ISR(INT2_vect, ISR_NOBLOCK) {
+#if EXPANDER
+    expanderChanged = TRUE;
+#else
+    FAST_EDGE(1)
+#endif
+}
 
-    for (iButton = 0; iButton < NUM_BUTTONS; iButton++) {
+/* Presses a button straight away, like an eager press. A falling edge
+   while the button is pressed or locked out is bounce, and one that has
+   already gone away again was noise. */
+static bool_t pressNow(uint8_t iButton, uint16_t edgeTicks) {
+    button_t button;
+    debounce_t* port;
+#if EVENT_LOG_SIZE
+    uint32_t now;
+#endif
 
-        button_t* button = &buttons[iButton];
-        bool_t rawState = getButtonState(button);
+    readButton(iButton, &button);
+    port = &debouncePorts[button.port];
+    if (((port->state | port->locked) & button.pin) || !isButtonHeld(&button)) {
+        return FALSE;
+    }
+#if EVENT_LOG_SIZE
+    now = clockTicks();
+#endif
 
-        if (rawState == button->debouncedState) {
-            resetCycles(button);
-        } else {
-            button->cyclesRemaining--;
-            if (button->cyclesRemaining == 0) {
-                button->debouncedState = rawState;
-                resetCycles(button);
-            }
-        }
+    port->state |= button.pin;
+    port->locked |= button.pin;
+    setCyclePlanes(port->cycles, button.pin, getCyclePlanes(port->pressCycles, button.pin));
+#if EVENT_LOG_SIZE
+    port->edgePending &= ~button.pin;
 
-        if (button->debouncedState) {
-            if (button->mod_mask != 0) {
-                reportBuffer[0] |= button->mod_mask;
-            } else if (iReport < SIMUL_BUTTONS) {
-                reportBuffer[++iReport] = button->key;
-            }
+    logEvent(iButton, TRUE, now, ((uint16_t)now - edgeTicks) / CLOCK_TICKS_PER_US);
+#endif
+    return TRUE;
+}
+
+static bool_t takeFastPresses(void) {
+    uint8_t edges;
+    uint16_t ticks[2];
+    uint8_t n;
+    bool_t changed = FALSE;
+
+    // the ticks are taken with the flags, as a new edge may rewrite them after
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        edges = fastEdges;
+        fastEdges = 0;
+        ticks[0] = fastEdgeTicks[0];
+        ticks[1] = fastEdgeTicks[1];
+    }
+    for (n = 0; n < 2; n++) {
+        if (edges & (1 << n)) {
+            changed |= pressNow(fastButtons[n], ticks[n]);
         }
     }
+    return changed;
+}
+
+// enables the edge interrupt of each fast button that is wired to its pin.
+static void initFastButtons(void) {
+    if (fastButtons[0] >= 0 && pgm_read_byte(&buttons[fastButtons[0]].port) == PORT_D
+        && pgm_read_byte(&buttons[fastButtons[0]].pin) == (1 << PD3)) {
+        MCUCR = (MCUCR & ~(1 << ISC10)) | (1 << ISC11); // falling edge
+        GIFR = (1 << INTF1);
+        GICR |= (1 << INT1);
+    }
+    if (fastButtons[1] >= 0 && pgm_read_byte(&buttons[fastButtons[1]].port) == PORT_B
+        && pgm_read_byte(&buttons[fastButtons[1]].pin) == (1 << PB2)) {
+        MCUCSR &= ~(1 << ISC2); // falling edge
+        GIFR = (1 << INTF2);
+        GICR |= (1 << INT2);
+    }
+}
+
+// selects the report mode, buildReport() places the buttons for it.
+void initReport(report_mode_t mode) {
+    player_t player;
+
+    reportMode = mode;
+    reportCount = (mode == REPORT_GAMEPAD) ? GAMEPAD_REPORT_COUNT : KEYBOARD_REPORT_COUNT;
+
+    // the newest report is what GET_REPORT answers and what changes are compared against.
+    for (player = 0; player < NUM_PLAYERS; player++) {
+        hid_interface_t* iface = &interfaces[player];
+        iface->idleRate = 125; // 500ms, the HID default for keyboards
+        iface->pollFrames = USB_CFG_INTR_POLL_INTERVAL; // until the host shows otherwise
+        buildReport(player, QUEUED_REPORT(iface, iface->tail - 1));
+#if EVENT_LOG_SIZE && REPORT_ID_BYTES
+        eventLogs[player].reportId = REPORT_ID_EVENTS;
+#endif
+    }
 }
 
 void initButtons() {
 
     int8_t iButton;
-    // pullup on all the inputs.
+    int8_t iPort;
+#if DEBOUNCE_MODE & DEBOUNCE_ADAPTIVE
+    uint8_t bit;
+#endif
+
+#if CHAIN_BYTES
+    initChain();
+#endif
+#if MATRIX_ROWS
+    initMatrix();
+#endif
+#if EXPANDER
+    initExpander();
+#endif
+
     for (iButton = 0; iButton < NUM_BUTTONS; iButton++) {
-        switch(buttons[iButton].port) {
-            case PORT_A:
-                PORTA |= buttons[iButton].pin;
-                break;
-            case PORT_B:
-                PORTB |= buttons[iButton].pin;
-                break;
-            case PORT_C:
-                PORTC |= buttons[iButton].pin;
-                break;
-            case PORT_D:
-                PORTD |= buttons[iButton].pin;
-                break;
-            default:
-                break;
+        button_t button;
+        debounce_t* port;
+
+        readButton(iButton, &button);
+        port = &debouncePorts[button.port];
+#if LINK_ROLE
+        if (button.port == PORT_D && (button.pin & LINK_PINS)) {
+            continue;
+        }
+#endif
+        port->mask |= button.pin;
+        setCyclePlanes(port->pressCycles, button.pin, DEPRESSED_CYCLES);
+        setCyclePlanes(port->releaseCycles, button.pin, RELEASED_CYCLES);
+    }
+    loadDebounceConfig();
+
+#if DEBOUNCE_MODE & DEBOUNCE_ADAPTIVE
+    // adaptive debounce starts out from the configured windows.
+    for (iButton = 0; iButton < NUM_BUTTONS; iButton++) {
+        button_t button;
+        debounce_t* port;
+        uint8_t pressCycles;
+        uint8_t releaseCycles;
+
+        readButton(iButton, &button);
+        port = &debouncePorts[button.port];
+        pressCycles = getCyclePlanes(port->pressCycles, button.pin);
+        releaseCycles = getCyclePlanes(port->releaseCycles, button.pin);
+
+        bit = 0;
+        while ((1 << bit) != button.pin) {
+            bit++;
         }
-        keycode_t key = buttons[iButton].key;
-        if (key >= MOD_LCTRL
-            && key <= MOD_RGUI) {
+        pinButtons[button.port][bit] = iButton;
 
-            buttons[iButton].mod_mask = (1 << (key - MOD_LCTRL));
+        if (pressCycles > ADAPT_MARGIN) {
+            bounces[iButton].worstBounce[TRUE] = pressCycles - ADAPT_MARGIN;
         }
+        if (releaseCycles > ADAPT_MARGIN) {
+            bounces[iButton].worstBounce[FALSE] = releaseCycles - ADAPT_MARGIN;
+        }
+    }
+#endif
+
+    for (iPort = 0; iPort < NUM_PORTS; iPort++) {
+        debounce_t* port = &debouncePorts[iPort];
+        memcpy(port->cycles, port->pressCycles, sizeof(port->cycles));
     }
+
+    // pullup on all the inputs.
+    PORTA |= debouncePorts[PORT_A].mask;
+    PORTB |= debouncePorts[PORT_B].mask;
+    PORTC |= debouncePorts[PORT_C].mask;
+    PORTD |= debouncePorts[PORT_D].mask;
+#if MOUSE_AXES
+    QUAD_PULLUP |= QUAD_MASK << QUAD_FIRST_PIN;
+#endif
 }
 
 //#define FLASH_LED
@@ -210,19 +1626,516 @@ void toggle_led(void) {
     }
 }
 
+/* Sampling. Timer2 runs in CTC mode, so the sample period is kept by the
+   hardware and the handler only has to copy the pins into the ring. It
+   re-enables interrupts straight away so the USB interrupt is never held
+   off; a sample can still be late by as long as a USB transaction takes.
+   The slot is claimed with interrupts off before it is written, so a nested
+   sample cannot take the same slot between the load and store of the head. */
+uint8_t sampleRing[SAMPLE_RING_SIZE][NUM_NATIVE_PORTS];
+#if EXTRA_BYTES
+uint8_t extraRing[EXTRA_RING_SIZE][EXTRA_BYTES];
+#endif
+volatile uint8_t sampleHead;
+
+#if EXTRA_BYTES
+static volatile bool_t extraBusy;       // a sample interrupt is reading the extra bytes
+static volatile bool_t extraDeferred;   // a nested one left its read to it
+static volatile uint8_t extraDeferredSample;
+
+/* Reads the extra bytes of sample n. A nested sample interrupt must not
+   start an SPI transfer or drive a matrix row in the middle of the outer
+   one's read, so it leaves its read to the outer interrupt, which does it
+   before it lets go of the bus. */
+static inline void sampleExtraBytes(uint8_t n) {
+    bool_t done = FALSE;
+
+    if (extraBusy) {
+        extraDeferredSample = n;
+        extraDeferred = TRUE;
+        return;
+    }
+    extraBusy = TRUE;
+    readExtraBytes(extraRing[(n / DEBOUNCE_DECIMATE) & (EXTRA_RING_SIZE - 1)]);
+    while (!done) {
+        ATOMIC_BLOCK(ATOMIC_FORCEON) {
+            n = extraDeferredSample;
+            done = !extraDeferred;
+            extraDeferred = FALSE;
+            extraBusy = !done;
+        }
+        if (!done) {
+            readExtraBytes(extraRing[(n / DEBOUNCE_DECIMATE) & (EXTRA_RING_SIZE - 1)]);
+        }
+    }
+}
+#endif
+
+ISR(TIMER2_COMP_vect, ISR_NOBLOCK) {
+    uint8_t a = PINA;
+    uint8_t b = PINB;
+    uint8_t c = PINC;
+    uint8_t d = PIND;
+    uint8_t n;
+    uint8_t* sample;
+
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        n = sampleHead++;
+    }
+    sample = sampleRing[n & (SAMPLE_RING_SIZE - 1)];
+
+    sample[PORT_A] = a;
+    sample[PORT_B] = b;
+    sample[PORT_C] = c;
+    sample[PORT_D] = d;
+#if EXTRA_BYTES
+    if ((n & (DEBOUNCE_DECIMATE - 1)) == 0) {
+        sampleExtraBytes(n);
+    }
+#endif
+#if LINK_ROLE
+    pollLink();
+#endif
+}
+
+#if ANALOG_AXES
+#if ANALOG_EXTRA_BITS > 3
+#error "the oversampling sums only hold 3 extra bits"
+#endif
+
+/* Analog sampling. The ADC converts continuously, one axis after the
+   other. A channel selected in the interrupt only applies to the
+   conversion after the one already under way, so the axis of each result
+   is tracked two conversions ahead. A conversion takes longer than any USB
+   transaction, so the handler can't be held off into the next one. */
+#define ANALOG_SAMPLES (1 << (2 * ANALOG_EXTRA_BITS))
+
+static uint8_t adcDone;     // axis of the finished conversion
+static uint8_t adcRunning;  // axis of the conversion under way
+static uint16_t adcSums[ANALOG_AXES];
+static uint8_t adcCounts[ANALOG_AXES];
+static volatile uint16_t analogValues[ANALOG_AXES]; // decimated, ANALOG_MAX full scale
+
+ISR(ADC_vect, ISR_NOBLOCK) {
+    uint16_t value = ADC;
+    uint8_t axis = adcDone;
+
+    adcDone = adcRunning;
+    if (++adcRunning == ANALOG_AXES) {
+        adcRunning = 0;
+    }
+    ADMUX = ANALOG_REFERENCE | (ANALOG_FIRST_CHANNEL + adcRunning);
+
+    adcSums[axis] += value;
+    if (++adcCounts[axis] == ANALOG_SAMPLES) {
+        analogValues[axis] = adcSums[axis] >> ANALOG_EXTRA_BITS;
+        adcSums[axis] = 0;
+        adcCounts[axis] = 0;
+    }
+}
+
+// takes the axes into analogReport when one has moved past the hysteresis.
+static bool_t takeAnalogChange(void) {
+    uint16_t values[ANALOG_AXES];
+    bool_t moved = FALSE;
+    uint8_t axis;
+
+    for (axis = 0; axis < ANALOG_AXES; axis++) {
+        // one axis at a time, so USB is never held off for longer than a word copy.
+        ATOMIC_BLOCK(ATOMIC_FORCEON) {
+            values[axis] = analogValues[axis];
+        }
+    }
+    for (axis = 0; axis < ANALOG_AXES; axis++) {
+        uint8_t* field = &analogReport[REPORT_ID_BYTES + 2 * axis];
+        int16_t delta = values[axis] - (field[0] | (field[1] << 8));
+
+        if (delta > ANALOG_HYSTERESIS || delta < -ANALOG_HYSTERESIS) {
+            moved = TRUE;
+        }
+    }
+    if (moved) {
+        memcpy(&analogReport[REPORT_ID_BYTES], values, sizeof(values));
+    }
+    return moved;
+}
+
+void initAnalog(void) {
+    ADMUX = ANALOG_REFERENCE | ANALOG_FIRST_CHANNEL;
+    SFIOR &= ~((1 << ADTS2) | (1 << ADTS1) | (1 << ADTS0)); // free running
+    ADCSRA = (1 << ADEN) | (1 << ADSC) | (1 << ADATE) | (1 << ADIE)
+        | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);    // F_CPU / 128
+}
+#endif
+
+/* A 1ms frame clock from a compare unit of the free running timer1. The
+   compare register is advanced by exactly one period per frame, so the
+   clock never drifts however late the main loop gets to it. Counting the
+   host's SOF markers (USB_COUNT_SOF) would need INT0 on D-, but this board
+   has it on D+, so the frame clock runs locally and the polling phase is
+   re-learned each time the host takes a report. */
+static volatile uint8_t frameCount;
+
+ISR(TIMER1_COMPB_vect, ISR_NOBLOCK) {
+    // the fast button interrupts also use the timer1 TEMP byte.
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        OCR1B += FRAME_PERIOD;
+    }
+    frameCount++;
+}
+
+#if EVENT_LOG_SIZE
+/* Splits a clock reading from the last few milliseconds into the frame it
+   fell in and the ticks since that frame started. */
+static uint16_t frameOffset(uint32_t ticks, uint8_t* frame) {
+    uint16_t nextFrame;
+    uint16_t until;
+    uint8_t framesBack;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        nextFrame = OCR1B;
+        *frame = frameCount;
+        if (TIFR & (1 << OCF1B)) {
+            nextFrame += FRAME_PERIOD;
+            (*frame)++;
+        }
+    }
+    until = nextFrame - (uint16_t)ticks;
+    framesBack = (until - 1) / FRAME_PERIOD;
+    *frame -= framesBack;
+    return (uint16_t)(framesBack + 1) * FRAME_PERIOD - until;
+}
+#endif
+
+static volatile uint16_t clockHigh;
+
+ISR(TIMER1_OVF_vect, ISR_NOBLOCK) {
+    clockHigh++;
+}
+
+uint32_t clockTicks(void) {
+    uint16_t high;
+    uint16_t low;
+
+    // short enough for the 25 cycles the USB interrupt may be held off.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        high = clockHigh;
+        low = TCNT1;
+        // an overflow that is still pending belongs to this reading if the counter has wrapped.
+        if ((TIFR & (1 << TOV1)) && low < 0x8000) {
+            high++;
+        }
+    }
+    return ((uint32_t)high << 16) | low;
+}
+
+void initScheduler(void) {
+    TCCR2 = (1 << WGM21) | (1 << CS21); // CTC, F_CPU / 8
+    OCR2 = F_CPU / 8 / SAMPLE_RATE - 1;
+    TIFR = (1 << OCF2);
+    TIMSK |= (1 << OCIE2);
+
+    TCCR1A = 0;
+    TCCR1B = (1 << CS10); // F_CPU / 1, normal mode
+    OCR1B = TCNT1 + FRAME_PERIOD;
+    TIFR = (1 << OCF1B) | (1 << TOV1);
+    TIMSK |= (1 << OCIE1B) | (1 << TOIE1);
+}
+
+#define interruptIsReady(player) \
+    ((player) == PLAYER_1 ? usbInterruptIsReady() : usbInterruptIsReady3())
+
+/* Learns when the host polls a player's endpoint. The frame in which a
+   loaded report disappears from the endpoint buffer carried an IN token,
+   and the shortest gap between two such frames with no poll missed in
+   between is the polling interval. Hosts may poll faster than the
+   interval in the endpoint descriptor, so it only ever shrinks. */
+static void trackPolls(player_t player) {
+    hid_interface_t* iface = &interfaces[player];
+    uint8_t frame = frameCount;
+    uint8_t elapsed;
+
+    if (iface->loaded && interruptIsReady(player)) {
+        iface->loaded = FALSE;
+        elapsed = frame - (uint8_t)(iface->nextPoll - iface->pollFrames);
+        if (iface->phaseKnown && iface->missedPolls == 0
+            && elapsed != 0 && elapsed < iface->pollFrames) {
+            iface->pollFrames = elapsed;
+        }
+        iface->phaseKnown = TRUE;
+        iface->missedPolls = 0;
+        iface->nextPoll = frame + iface->pollFrames;
+    }
+    while ((int8_t)(frame - iface->nextPoll) > 0) {
+        iface->nextPoll += iface->pollFrames;
+        iface->missedPolls++;
+    }
+}
+
+/* A free interrupt slot takes the player's next queued change, or repeats
+   the newest report once the idle period has expired. Changes go out
+   straight away, but a repeat waits for the frame before the host's next
+   poll so that it carries the freshest state. Analog axes and then mouse
+   motion take the slots the buttons leave free, they are never repeated. */
+static void sendReport(player_t player) {
+    hid_interface_t* iface = &interfaces[player];
+    uint8_t* report;
+    uint8_t count = reportCount;
+    uint8_t* tx;
+    uint8_t i;
+    bool_t changed = FALSE;
+
+    if (!interruptIsReady(player)) {
+        return;
+    }
+
+    if (iface->head != iface->tail) {
+        report = QUEUED_REPORT(iface, iface->head);
+        iface->head++;
+        iface->idleExpired = FALSE;
+        iface->idleTicks = 0;
+    } else if (iface->idleExpired
+               && (!iface->phaseKnown
+                   || (uint8_t)(iface->nextPoll - frameCount) <= 1)) {
+        report = QUEUED_REPORT(iface, iface->tail - 1);
+        iface->idleExpired = FALSE;
+        iface->idleTicks = 0;
+    }
+#if ANALOG_AXES
+    else if (player == ANALOG_PLAYER && takeAnalogChange()) {
+        report = analogReport;
+        count = ANALOG_REPORT_COUNT;
+    }
+#endif
+#if MOUSE_AXES
+    else if (player == MOUSE_PLAYER && takeMouseMotion()) {
+        report = mouseReport;
+        count = MOUSE_REPORT_COUNT;
+    }
+#endif
+    else {
+        return;
+    }
+
+    /* The report is compared with the endpoint buffer, which still holds the
+       last one sent, and only the bytes that differ are copied. The buffer
+       doubles as the driver's copy, so the usual usbSetInterrupt() copy is
+       saved, and an idle repeat leaves every byte alone and skips the CRC. */
+    tx = player == PLAYER_1 ? usbInterruptBuffer() : usbInterruptBuffer3();
+    for (i = 0; i < count; i++) {
+        if (tx[i] != report[i]) {
+            tx[i] = report[i];
+            changed = TRUE;
+        }
+    }
+
+    if (player == PLAYER_1) {
+        usbCommitInterrupt(count, changed);
+    } else {
+        usbCommitInterrupt3(count, changed);
+    }
+    iface->loaded = TRUE;
+}
+
+#if LINK_ROLE
+/* Link frames: LINK_SYNC, the board number in the high and a sequence
+   number in the low nibble, a mask of the board's bytes that follow, the
+   bytes and a CRC-8 of everything after the sync. A receiver that loses
+   its place looks for the next sync, and the CRC rejects a sync byte
+   found in the middle of a frame. */
+static uint8_t linkFrame[LINK_FRAME_MAX];
+static uint8_t linkFrameLength;     // bytes received, 0 while looking for a sync
+static uint8_t linkFrameExpected;
+// frames rejected for their CRC, mask or board number, and frames missed.
+uint16_t linkErrors;
+uint16_t linkGaps;
+
+#if LINK_ROLE == LINK_PRIMARY
+static uint8_t linkSeqs[LINK_BOARDS];   // last sequence number of each secondary
+static uint8_t linkLife[LINK_BOARDS];   // frames left before it counts as silent
+static uint8_t linkFramesDone;
+#else
+static uint8_t linkSent[LINK_BOARD_BYTES];
+static uint8_t linkSeq;
+static uint8_t linkRefreshFrame;
+#endif
+
+// queues a whole frame for sending, or nothing if the ring has no room.
+static bool_t queueLinkFrame(const uint8_t* frame, uint8_t length) {
+    uint8_t head = linkTxHead;
+    uint8_t i;
+
+    if ((uint8_t)(LINK_RING_SIZE - (head - linkTxTail)) < length) {
+        return FALSE;
+    }
+    for (i = 0; i < length; i++) {
+        linkTx[head++ & (LINK_RING_SIZE - 1)] = frame[i];
+    }
+    linkTxHead = head;
+    return TRUE;
+}
+
+static void takeLinkFrame(const uint8_t* frame, uint8_t length) {
+#if LINK_ROLE == LINK_PRIMARY
+    uint8_t board = (frame[1] >> 4) - 1;
+    const uint8_t* value = frame + 3;
+    volatile uint8_t* pins;
+    uint8_t i;
+
+    if (board >= LINK_BOARDS) {
+        linkErrors++;
+        return;
+    }
+    if (linkLife[board] && ((frame[1] - linkSeqs[board]) & 0x0f) != 1) {
+        linkGaps++;
+    }
+    linkSeqs[board] = frame[1];
+    linkLife[board] = LINK_TIMEOUT_FRAMES;
+
+    pins = &linkPins[board * LINK_BOARD_BYTES];
+    for (i = 0; i < LINK_BOARD_BYTES; i++) {
+        if (frame[2] & (1 << i)) {
+            pins[i] = ~*value++;
+        }
+    }
+#else
+    // frames from further down the chain are passed on as they are.
+    if (!queueLinkFrame(frame, length)) {
+        linkOverruns++;
+    }
+#endif
+}
+
+static void receiveLink(void) {
+    uint8_t head = linkRxHead;
+
+    while (linkRxTail != head) {
+        uint8_t byte = linkRx[linkRxTail++ & (LINK_RING_SIZE - 1)];
+        uint8_t crc = 0;
+        uint8_t i;
+
+        if (linkFrameLength == 0) {
+            if (byte == LINK_SYNC) {
+                linkFrame[linkFrameLength++] = byte;
+            }
+            continue;
+        }
+        linkFrame[linkFrameLength++] = byte;
+
+        if (linkFrameLength == 3) {
+            if (byte >> LINK_BOARD_BYTES) {
+                linkErrors++;
+                linkFrameLength = 0;
+                continue;
+            }
+            linkFrameExpected = 4;
+            for (; byte; byte &= byte - 1) {
+                linkFrameExpected++;
+            }
+        } else if (linkFrameLength > 3 && linkFrameLength == linkFrameExpected) {
+            for (i = 1; i < linkFrameLength - 1; i++) {
+                crc = _crc_ibutton_update(crc, linkFrame[i]);
+            }
+            if (crc == byte) {
+                takeLinkFrame(linkFrame, linkFrameLength);
+            } else {
+                linkErrors++;
+            }
+            linkFrameLength = 0;
+        }
+    }
+}
+
+#if LINK_ROLE == LINK_PRIMARY
+// releases the buttons of secondaries that have gone silent.
+static void tickLink(void) {
+    uint8_t elapsed = frameCount - linkFramesDone;
+    uint8_t board;
+
+    if (elapsed == 0) {
+        return;
+    }
+    linkFramesDone += elapsed;
+    for (board = 0; board < LINK_BOARDS; board++) {
+        if (linkLife[board] == 0) {
+            continue;
+        }
+        if (elapsed >= linkLife[board]) {
+            linkLife[board] = 0;
+            memset((void*)&linkPins[board * LINK_BOARD_BYTES], 0xff, LINK_BOARD_BYTES);
+        } else {
+            linkLife[board] -= elapsed;
+        }
+    }
+}
+#else
+/* Sends the debounced bytes that changed since the last frame, or all of
+   them once a refresh is due. A frame that doesn't fit the ring is built
+   again on the next pass, with the state of that pass. */
+static void sendLinkState(void) {
+    uint8_t frame[LINK_FRAME_MAX];
+    uint8_t length = 3;
+    uint8_t mask = 0;
+    uint8_t crc = 0;
+    bool_t refresh = (uint8_t)(frameCount - linkRefreshFrame) >= LINK_REFRESH_FRAMES;
+    uint8_t i;
+
+    for (i = 0; i < LINK_BOARD_BYTES; i++) {
+        uint8_t state = debouncePorts[i].state;
+        if (refresh || state != linkSent[i]) {
+            mask |= (1 << i);
+            frame[length++] = state;
+        }
+    }
+    if (mask == 0) {
+        return;
+    }
+
+    frame[0] = LINK_SYNC;
+    frame[1] = (LINK_BOARD << 4) | (linkSeq & 0x0f);
+    frame[2] = mask;
+    for (i = 1; i < length; i++) {
+        crc = _crc_ibutton_update(crc, frame[i]);
+    }
+    frame[length++] = crc;
+    if (!queueLinkFrame(frame, length)) {
+        return;
+    }
+
+    linkSeq++;
+    for (i = 0; i < LINK_BOARD_BYTES; i++) {
+        linkSent[i] = debouncePorts[i].state;
+    }
+    if (refresh) {
+        linkRefreshFrame = frameCount;
+    }
+}
+
+// a secondary board only samples, debounces and sends, it never talks USB.
+static void runSecondary(void) {
+    wdt_enable(WDTO_1S);
+    initScheduler();
+    initLink();
+    sei();
+
+    while (1) {
+        wdt_reset();
+        receiveLink();
+        if (sampleHead != sampleTail) {
+            debounceButtons();
+        }
+        sendLinkState();
+    }
+}
+#endif
+#endif
+
 //TODO
 //
-//* Probably just need to implement get_idle, set_idle, get_report (prob not used)
 //* test poll rate is as expected, how is poll rate set?
 //* check that timer is correctly initialized, scope?
 //* test the device functionality from startup.
 //* see how much we can reduce the depressed/release cycles to.
-// 
-// idle implementation:
-// if idle is 0, only send when report has changed.
-// if non-zero, send every idle * 4ms
-// if polled and not time to send yet, send NAK
-// if anything changed, report anyway
 //
 // keyboard
 // non-modifiers must be input,array,absolute
@@ -232,6 +2145,10 @@ void toggle_led(void) {
 
 int main(void) {
 
+    uint8_t idleFramesDone = 0;
+    player_t player;
+    bool_t changed;
+    button_t select;
 #ifdef KEY_TEST
     uint16_t slow_timer = 0;
 #endif
@@ -240,8 +2157,20 @@ int main(void) {
     flash_led();
 #endif
 
+    initButtons();
+#if LINK_ROLE == LINK_SECONDARY
+    runSecondary();
+#endif
+
+    // the pull-ups settle while we are disconnected.
     usbDeviceDisconnect();
     _delay_ms(500);
+    readButton(GAMEPAD_SELECT_BUTTON, &select);
+    if (isButtonHeld(&select)) {
+        initReport(REPORT_GAMEPAD);
+    } else {
+        initReport(REPORT_KEYBOARD);
+    }
     usbDeviceConnect();
 
     wdt_enable(WDTO_1S);
@@ -250,39 +2179,69 @@ int main(void) {
     GICR |= IVCE;
     GICR |= IVSEL;
 
-    sei();
-
-    TCCR0 = 0x5; // F_CPU / 1024
-    TCCR1B = 0x1; // F_CPU / 1
-    TCNT0 = 0;
-    TCNT1 = 0;
-    memset(reportBuffer, 0, sizeof(reportBuffer));
+    initScheduler();
+    initFastButtons();
+#if ANALOG_AXES
+    initAnalog();
+#endif
+#if LINK_ROLE == LINK_PRIMARY
+    initLink();
+#endif
 
-    initButtons();
+    sei();
 
     //PORTD |= RED_LED;
 
     while(1) {
         wdt_reset();
         usbPoll();
+#if EXPANDER
+        stepExpander();
+#endif
+#if LINK_ROLE == LINK_PRIMARY
+        receiveLink();
+        tickLink();
+#endif
 
-        if (TCNT1 > 1200) { //1200 = 100us
-            TCNT1 = 0;
-            debounceButtons(reportBuffer);
+        changed = FALSE;
+        if (fastEdges) {
+            changed = takeFastPresses();
+        }
+        if (sampleHead != sampleTail) {
+            changed |= debounceButtons();
+        }
+        if (changed) {
+            for (player = 0; player < NUM_PLAYERS; player++) {
+                interfaces[player].stale = TRUE;
+            }
         }
 
-        if (TCNT0 > 47) { //47 == 4ms approx
-            TCNT0 = 0;
+        // with a non-zero idle rate the last report is repeated every idleRate * 4ms.
+        if ((uint8_t)(frameCount - idleFramesDone) >= IDLE_TICK_FRAMES) {
+            idleFramesDone += IDLE_TICK_FRAMES;
+            for (player = 0; player < NUM_PLAYERS; player++) {
+                hid_interface_t* iface = &interfaces[player];
+                if (iface->idleRate != 0 && ++iface->idleTicks >= iface->idleRate) {
+                    iface->idleExpired = TRUE;
+                }
+            }
 #ifdef KEY_TEST
             if (++slow_timer > 500) {
-                reportBuffer[1] = KEY_A;
+                hid_interface_t* iface = &interfaces[PLAYER_1];
+                uint8_t* back = QUEUED_REPORT(iface, iface->tail);
+                memset(back, 0, reportCount);
+                back[1] = KEY_A;
+                iface->tail++;
                 slow_timer = 0;
                 PORTD |= RED_LED;
             }
 #endif
-            if(usbInterruptIsReady()) {
-                usbSetInterrupt(reportBuffer, sizeof(reportBuffer));
-            }
+        }
+
+        for (player = 0; player < NUM_PLAYERS; player++) {
+            trackPolls(player);
+            publishReport(player);
+            sendReport(player);
         }
     }
 }
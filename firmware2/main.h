@@ -44,16 +44,178 @@
 #define P2_E (1 << 3) //green
 #define P2_F (1 << 5) //orange
 
-#define DEPRESSED_CYCLES 7
-#define RELEASED_CYCLES 4
+// rate at which timer2 samples the input ports.
+#define SAMPLE_RATE     20000
+#define SAMPLE_RING_SIZE 32     // must be a power of two
+/* Only every DEBOUNCE_DECIMATE-th sample is debounced, which keeps the
+   debounce to a quarter of the CPU. Debounce windows count these ticks of
+   1000000 / DEBOUNCE_RATE us. Must be a power of two. */
+#define DEBOUNCE_DECIMATE 4
+#define DEBOUNCE_RATE (SAMPLE_RATE / DEBOUNCE_DECIMATE)
 
+// define to 1 to report keys as a bitmap (N-key rollover) instead of an array of keycodes.
+#define KEYBOARD_NKRO 0
+
+// holding this entry of buttons[] while plugging in selects the gamepad report.
+#define GAMEPAD_SELECT_BUTTON 0 // p1 start
+
+// report buffers per player, must be a power of two. All but two can wait for the host.
+#define REPORT_QUEUE_SIZE 8
+// longest report of any mode.
+#define REPORT_MAX_COUNT 8
+
+// length of a USB frame in timer1 ticks (F_CPU / 1).
+#define FRAME_PERIOD    12000   // 1ms
+// HID idle rates count in units of 4ms.
+#define IDLE_TICK_FRAMES 4
+
+#define DEPRESSED_CYCLES 4
+#define RELEASED_CYCLES 2
+
+/* Debounce strategy, a combination of the DEBOUNCE_EAGER_* flags. By default
+   a change is only accepted after the full window of matching ticks. An
+   eager direction is reported on the first sampled edge instead, and the
+   window is then used as a lockout during which the bounce is ignored. */
+#define DEBOUNCE_EAGER_PRESS    (1 << 0)
+#define DEBOUNCE_EAGER_RELEASE  (1 << 1)
+/* With DEBOUNCE_ADAPTIVE the firmware times the bounce of every transition
+   and moves each button's windows to ADAPT_MARGIN ticks above the worst
+   bounce it has seen, within ADAPT_MIN_CYCLES..DEBOUNCE_MAX_CYCLES. The
+   worst case decays by one tick after ADAPT_DECAY_EPISODES transitions
+   that bounced for less, so windows also shrink for good switches. Its
+   state is only built in when DEBOUNCE_MODE includes it, the mode from
+   EEPROM can't turn it on otherwise. */
+#define DEBOUNCE_ADAPTIVE       (1 << 2)
+#define DEBOUNCE_MODE 0
+
+#define ADAPT_MARGIN 2
+#define ADAPT_MIN_CYCLES 2
+#define ADAPT_DECAY_EPISODES 32
+
+/* Width of the per-pin debounce counters, cycle counts must fit in it.
+   Six bits take windows up to 63 ticks, long enough for worn switches,
+   and also bound how long a bounce may pause before it counts as over. */
+#define DEBOUNCE_COUNTER_BITS 6
+#define DEBOUNCE_MAX_CYCLES ((1 << DEBOUNCE_COUNTER_BITS) - 1)
+
+/* Entries of buttons[] wired to INT1 (PD3) and INT2 (PB2), -1 for none.
+   Their presses are taken from the edge interrupt as soon as they happen,
+   as with DEBOUNCE_EAGER_PRESS, and locked out for the press window.
+   Releases are debounced as usual. Meant for attack buttons, a direction
+   on them would bypass DEBOUNCE_MODE. */
+#define FAST_BUTTON_INT1 -1
+#define FAST_BUTTON_INT2 -1
+
+/* Input events kept per player for the event feature report, 0 to leave
+   the report out, along with the 9 bytes per input byte that time edges. */
+#define EVENT_LOG_SIZE 4
+
+/* 74HC165 shift registers chained on the SPI bus, 0 for none. SCK drives
+   their CLK, the last register's QH drives MISO and CHAIN_LOAD on the SS
+   pin drives every SH/LD, so PB4, PB6 and PB7 can't take buttons. Each
+   register costs EXTRA_RING_SIZE + sizeof(debounce_t) bytes of RAM, 38
+   with the event log and 29 without, and is read in about 2us of every
+   DEBOUNCE_DECIMATE-th sample interrupt. Buttons only take flash, so with
+   the event log 7 registers fit, 56 inputs beside the native pins, and 12
+   without it. Adaptive debounce needs 6 bytes per button and 11 per port
+   on top, which leaves room for one register, two without the log.
+   `make hex` fails when the static RAM leaves too little for the stack. */
+#define CHAIN_BYTES 0
+#define CHAIN_LOAD (1 << 4) // portB
+
+/* Button matrix, 0 rows for none. Rows are pins 0..MATRIX_ROWS-1 of the
+   row port and are pulled low one at a time, columns are the MATRIX_COLS
+   pins of the column port with pull-ups. No port is free on this board,
+   so the default columns PC2-PC6 leave out the TWI pins and p1 down on
+   PC7, and the rows on PB0.. must not meet the encoders, INT2 or the
+   chain. Without diodes, two rows sharing two pressed columns can't be
+   told from a ghost, and such scans are dropped. A full scan takes about
+   MATRIX_ROWS * (MATRIX_SETTLE_US + 1)us. */
+#define MATRIX_ROWS 0
+#define MATRIX_ROW_DDR DDRB
+#define MATRIX_COL_PIN PINC
+#define MATRIX_COL_PORT PORTC
+#define MATRIX_COLS 0x7c        // PC2-PC6
+#define MATRIX_SETTLE_US 1
+
+/* MCP23017 I2C port expander on the TWI pins (PC0, PC1), 0 for none. Its
+   mirrored, open-drain INTA line goes to INT2 (PB2), which then can't be
+   a fast button, and the expander is only read after it signals a change.
+   GPA and GPB are two more input bytes with the expander's pull-ups. */
+#define EXPANDER 0
+#define EXPANDER_ADDRESS 0x20   // A0-A2 tied low
+#define EXPANDER_BYTES (EXPANDER ? 2 : 0)
+
+/* Quadrature encoders of trackballs and spinners, 0 for none, at most 2.
+   Axis n has its A and B outputs on pins QUAD_FIRST_PIN + 2n and + 2n + 1
+   of the encoder port. They are decoded from every sample, which follows
+   up to SAMPLE_RATE transitions per second per axis, and reported as a
+   relative mouse on the interface of MOUSE_PLAYER. A mouse needs report
+   IDs, so the array keyboard report then has one key less. */
+#define MOUSE_AXES 0
+#define MOUSE_PLAYER PLAYER_1
+#define QUAD_PORT PORT_B        // sample byte of the encoder pins
+#define QUAD_PULLUP PORTB
+#define QUAD_FIRST_PIN 0        // PB0-PB3, PB2 is lost to INT2 with two axes
+
+/* Paddles and pedals on the ADC, 0 for none, at most 3. Axis n is read
+   from channel ANALOG_FIRST_CHANNEL + n, which shares its pin with port A,
+   so PA7 is the only one left on this board. The ADC runs free at
+   F_CPU / 128, 7200 conversions per second shared by the axes, and 4^n
+   conversions are summed for n extra bits (at most 3), which needs a
+   little noise on the input to work. Values moving by more than
+   ANALOG_HYSTERESIS are sent as absolute axes on the interface of
+   ANALOG_PLAYER. */
+#define ANALOG_AXES 0
+#define ANALOG_PLAYER PLAYER_1
+#define ANALOG_FIRST_CHANNEL 7
+#define ANALOG_REFERENCE (1 << REFS0)   // AVCC
+#define ANALOG_EXTRA_BITS 2
+#define ANALOG_HYSTERESIS 2
+
+/* Several boards behind one USB device. A secondary board only samples
+   and debounces, and sends its first LINK_BOARD_BYTES input bytes to the
+   primary over the UART as deltas, with the full state at least every
+   LINK_REFRESH_FRAMES. Boards are daisy chained, TXD to the RXD of the
+   next board towards the primary, and each secondary forwards what it
+   receives. The primary reads byte M of secondary N as PORT_LINK((N - 1)
+   * LINK_BOARD_BYTES + M), takes those levels without debouncing them
+   again, and releases a board's buttons when it has been silent for
+   LINK_TIMEOUT_FRAMES. The link takes RXD (PD0) on every board and TXD
+   (PD1) on secondaries, buttons on them are ignored. */
+#define LINK_NONE 0
+#define LINK_PRIMARY 1
+#define LINK_SECONDARY 2
+#define LINK_ROLE LINK_NONE
+#define LINK_BOARD 1            // number of a secondary, 1-15
+#define LINK_BOARDS 1           // secondaries behind the primary
+#define LINK_BOARD_BYTES 2      // at most 8
+#define LINK_BAUD 125000        // F_CPU / 8 must be a multiple
+#define LINK_REFRESH_FRAMES 20
+#define LINK_TIMEOUT_FRAMES 50
+#define LINK_BYTES (LINK_ROLE == LINK_PRIMARY ? LINK_BOARDS * LINK_BOARD_BYTES : 0)
+
+/* Input bytes debounced together: the native ports, then one per register
+   of the chain, one per matrix row, the expander's GPA and GPB and the
+   bytes of the linked boards. Chain byte 0 is the register whose QH drives
+   MISO, so buttons[] addresses bit M of chain byte N as PORT_CHAIN(N), M,
+   column M of matrix row N as PORT_MATRIX(N), M and pin M of expander
+   bank N as PORT_EXPANDER(N), M. */
 typedef enum {
     PORT_A,
     PORT_B,
     PORT_C,
     PORT_D,
+    NUM_NATIVE_PORTS
 } port_t;
 
+#define PORT_CHAIN(n) ((port_t)(NUM_NATIVE_PORTS + (n)))
+#define PORT_MATRIX(n) ((port_t)(NUM_NATIVE_PORTS + CHAIN_BYTES + (n)))
+#define PORT_EXPANDER(n) ((port_t)(NUM_NATIVE_PORTS + CHAIN_BYTES + MATRIX_ROWS + (n)))
+#define PORT_LINK(n) ((port_t)(NUM_NATIVE_PORTS + CHAIN_BYTES + MATRIX_ROWS + EXPANDER_BYTES + (n)))
+#define EXTRA_BYTES (CHAIN_BYTES + MATRIX_ROWS + EXPANDER_BYTES + LINK_BYTES)
+#define NUM_PORTS (NUM_NATIVE_PORTS + EXTRA_BYTES)
+
 typedef uint8_t bool_t;
 
 /* The USB keycodes are enumerated here - the first part is simply
@@ -174,13 +336,121 @@ typedef enum keycodes {
   MOD_RGUI,     // 0x80
 } keycode_t;
 
+/* Raw port samples, written by the sample interrupt at SAMPLE_RATE. Slot
+   (n & (SAMPLE_RING_SIZE - 1)) holds PINA-PIND of sample n, sampleHead is
+   the number of the next sample. The extra input bytes are only read for
+   the samples that get debounced, slot ((n / DEBOUNCE_DECIMATE) &
+   (EXTRA_RING_SIZE - 1)) of extraRing holds those of sample n. Every
+   consumer keeps its own tail and has fallen behind if it is more than
+   SAMPLE_RING_SIZE samples from the head. */
+#define EXTRA_RING_SIZE (SAMPLE_RING_SIZE / DEBOUNCE_DECIMATE)
+
+extern uint8_t sampleRing[SAMPLE_RING_SIZE][NUM_NATIVE_PORTS];
+#if EXTRA_BYTES
+extern uint8_t extraRing[EXTRA_RING_SIZE][EXTRA_BYTES];
+#endif
+extern volatile uint8_t sampleHead;
+
+/* Monotonic clock in timer1 ticks (F_CPU / 1), wrapping after about six
+   minutes at 12MHz, so compare readings by their difference. Timer1 runs
+   free and its overflows extend it to 32 bits. Call it from the main loop,
+   not from an interrupt. */
+#define CLOCK_TICKS_PER_US (F_CPU / 1000000)
+uint32_t clockTicks(void);
+
+// each player is a separate HID interface with its own endpoint.
+typedef enum {
+    PLAYER_1,
+    PLAYER_2,
+    NUM_PLAYERS
+} player_t;
+
+typedef enum {
+    REPORT_KEYBOARD,
+    REPORT_GAMEPAD,
+} report_mode_t;
+
+// gamepad inputs, buttons are numbered from 1.
+#define PAD_BUTTON(n) ((n) - 1)
+#define PAD_UP      0x10
+#define PAD_DOWN    0x11
+#define PAD_LEFT    0x12
+#define PAD_RIGHT   0x13
+#define PAD_NONE    0xff
+
+/* One entry of the button table, which is kept in flash. The enums are
+   held in bytes, as they would take two each. */
 typedef struct {
-    port_t port;
+    uint8_t port;           // port_t
     uint8_t pin;
-    bool_t debouncedState; //non-zero indicates that the button is being pressed.
-    int8_t cyclesRemaining;
-    keycode_t key;
-    uint8_t mod_mask;
+    uint8_t key;            // keycode_t
+    uint8_t pad;            // PAD_BUTTON(n) or PAD_<direction> in gamepad mode
+    uint8_t player;         // player_t
 } button_t;
 
+#if DEBOUNCE_MODE & DEBOUNCE_ADAPTIVE
+// bounce timing of one entry of the button table, for adaptive debounce.
+typedef struct {
+    uint8_t bounceAge;      // ticks since the first edge of the current bounce
+    uint8_t bounceLast;     // bounceAge at the latest edge
+    uint8_t worstBounce[2]; // longest bounce seen, for release and press
+    uint8_t quietCount[2];  // transitions since worstBounce was last reached
+} bounce_t;
+#endif
+
+typedef struct {
+    uint8_t queue[REPORT_QUEUE_SIZE][REPORT_MAX_COUNT];
+    uint8_t head;           // next report to send
+    uint8_t tail;           // back buffer, the next report is built here
+    bool_t stale;           // buttons changed since the report was built
+    uint8_t idleRate;       // in 4ms units, 0 means only report changes
+    uint8_t idleTicks;
+    bool_t idleExpired;
+    bool_t loaded;          // a report waits in the endpoint buffer
+    bool_t phaseKnown;      // the host has taken at least one report
+    uint8_t pollFrames;     // host polling interval in frames
+    uint8_t nextPoll;       // frame of the next expected IN token
+    uint8_t missedPolls;    // expected IN tokens since the last one seen
+} hid_interface_t;
+
+/* Debounce state for all eight pins of one port. The counters are stored
+   "vertically": bit n of cycles[k] is bit k of pin n's counter, so a whole
+   port is counted down with a few logic ops per bit plane. */
+typedef struct {
+    uint8_t mask;           // pins that have a button attached
+    uint8_t state;          // debounced state, a set bit means pressed
+    uint8_t locked;         // pins ignoring input after an eager change
+#if DEBOUNCE_MODE & DEBOUNCE_ADAPTIVE
+    uint8_t raw;            // previous raw sample, for adaptive debounce
+    uint8_t bouncing;       // pins with a bounce being timed
+    uint8_t decided;        // bouncing pins whose change has been taken
+#endif
+    uint8_t cycles[DEBOUNCE_COUNTER_BITS];
+    uint8_t pressCycles[DEBOUNCE_COUNTER_BITS];     // reload while released
+    uint8_t releaseCycles[DEBOUNCE_COUNTER_BITS];   // reload while pressed
+#if EVENT_LOG_SIZE
+    uint8_t edgePending;    // pins with a raw edge that is not decided yet
+    uint8_t edgeTick[8];    // debounce tick of each pin's first raw edge
+#endif
+} debounce_t;
+
+/* One debounced change, as timed on the device. Times are in microseconds
+   and resolved to a sample period. */
+typedef struct {
+    uint8_t button;         // index in buttons[], bit 7 set for a press
+    uint8_t frame;          // frame in which the change was decided
+    uint16_t decisionUs;    // decision time from the start of that frame
+    uint16_t edgeUs;        // time from the first raw edge to the decision
+} input_event_t;
+
+/* Feature report of each player's interface. A host tool compares the
+   frames with the poll that delivered the change to measure the whole
+   press-to-host latency. */
+typedef struct {
+    uint8_t reportId;       // only sent when the reports have IDs
+    uint8_t count;          // events logged so far, event n is in events[n % EVENT_LOG_SIZE]
+    uint8_t pollFrame;      // frame of the last IN token seen on this interface
+    input_event_t events[EVENT_LOG_SIZE];
+} event_log_t;
+
 #endif
@@ -216,34 +216,76 @@ static inline void  usbResetStall(void)
 
 #if !USB_CFG_SUPPRESS_INTR_CODE
 #if USB_CFG_HAVE_INTRIN_ENDPOINT
+static void usbGenericTxBegin(usbTxStatus_t *txStatus)
+{
+    if(txStatus->len & 0x10){   /* packet buffer was empty */
+        txStatus->buffer[0] ^= USBPID_DATA0 ^ USBPID_DATA1; /* toggle token */
+    }else{
+        txStatus->len = USBPID_NAK; /* avoid sending outdated (overwritten) interrupt data */
+    }
+}
+
+static void usbGenericTxEnd(uchar len, usbTxStatus_t *txStatus)
+{
+    txStatus->len = len + 4;    /* len must be given including sync byte */
+    DBG2(0x21 + (((int)txStatus >> 3) & 3), txStatus->buffer, len + 3);
+}
+
 static void usbGenericSetInterrupt(uchar *data, uchar len, usbTxStatus_t *txStatus)
 {
 uchar   *p;
 char    i;
+uchar   diff = 0;
 
 #if USB_CFG_IMPLEMENT_HALT
     if(usbTxLen1 == USBPID_STALL)
         return;
 #endif
-    if(txStatus->len & 0x10){   /* packet buffer was empty */
-        txStatus->buffer[0] ^= USBPID_DATA0 ^ USBPID_DATA1; /* toggle token */
-    }else{
-        txStatus->len = USBPID_NAK; /* avoid sending outdated (overwritten) interrupt data */
-    }
+    usbGenericTxBegin(txStatus);
     p = txStatus->buffer + 1;
     i = len;
     do{                         /* if len == 0, we still copy 1 byte, but that's no problem */
+        diff |= *p ^ *data;
         *p++ = *data++;
     }while(--i > 0);            /* loop control at the end is 2 bytes shorter than at beginning */
-    usbCrc16Append(&txStatus->buffer[1], len);
-    txStatus->len = len + 4;    /* len must be given including sync byte */
-    DBG2(0x21 + (((int)txStatus >> 3) & 3), txStatus->buffer, len + 3);
+    /* Reuse the CRC of the last message if the data did not change. A CRC
+     * can't be patched for a few changed bytes without running over the rest
+     * of the message anyway, so any difference recomputes all of it.
+     */
+    if(diff || txStatus->crcLen != len + 1){
+        usbCrc16Append(&txStatus->buffer[1], len);
+        txStatus->crcLen = len + 1;
+    }
+    usbGenericTxEnd(len, txStatus);
+}
+
+static void usbGenericCommitInterrupt(uchar len, uchar changed, usbTxStatus_t *txStatus)
+{
+#if USB_CFG_IMPLEMENT_HALT
+    if(usbTxLen1 == USBPID_STALL)
+        return;
+#endif
+    usbGenericTxBegin(txStatus);
+    /* The CRC only covers the data bytes, so when they are the same as in the
+     * last packet only the data toggle above has changed and the CRC stored
+     * behind the data is still valid.
+     */
+    if(changed || txStatus->crcLen != len + 1){
+        usbCrc16Append(&txStatus->buffer[1], len);
+        txStatus->crcLen = len + 1;
+    }
+    usbGenericTxEnd(len, txStatus);
 }
 
 USB_PUBLIC void usbSetInterrupt(uchar *data, uchar len)
 {
     usbGenericSetInterrupt(data, len, &usbTxStatus1);
 }
+
+USB_PUBLIC void usbCommitInterrupt(uchar len, uchar changed)
+{
+    usbGenericCommitInterrupt(len, changed, &usbTxStatus1);
+}
 #endif
 
 #if USB_CFG_HAVE_INTRIN_ENDPOINT3
@@ -251,6 +293,11 @@ USB_PUBLIC void usbSetInterrupt3(uchar *data, uchar len)
 {
     usbGenericSetInterrupt(data, len, &usbTxStatus3);
 }
+
+USB_PUBLIC void usbCommitInterrupt3(uchar len, uchar changed)
+{
+    usbGenericCommitInterrupt(len, changed, &usbTxStatus3);
+}
 #endif
 #endif /* USB_CFG_SUPPRESS_INTR_CODE */
 
@@ -231,7 +231,8 @@ USB_PUBLIC void usbSetInterrupt(uchar *data, uchar len);
 /* This function sets the message which will be sent during the next interrupt
  * IN transfer. The message is copied to an internal buffer and must not exceed
  * a length of 8 bytes. The message may be 0 bytes long just to indicate the
- * interrupt status to the host.
+ * interrupt status to the host. If the message is the same as the last one,
+ * its CRC is not computed again.
  * If you need to transfer more bytes, use a control read after the interrupt.
  */
 #define usbInterruptIsReady()   (usbTxLen1 & 0x10)
@@ -239,9 +240,21 @@ USB_PUBLIC void usbSetInterrupt(uchar *data, uchar len);
  * sent. If you set a new interrupt message before the old was sent, the
  * message already buffered will be lost.
  */
+#define usbInterruptBuffer()    (usbTxBuf1 + 1)
+USB_PUBLIC void usbCommitInterrupt(uchar len, uchar changed);
+/* Zero-copy alternative to usbSetInterrupt(): while usbInterruptIsReady() is
+ * true, the application may write the message directly to the buffer
+ * returned by usbInterruptBuffer() and then pass its length to
+ * usbCommitInterrupt(). Bytes that are not rewritten keep the value of the
+ * last message. Pass a non-zero 'changed' if any byte differs from the last
+ * message; otherwise the CRC of the last message is sent again and only the
+ * data toggle changes.
+ */
 #if USB_CFG_HAVE_INTRIN_ENDPOINT3
 USB_PUBLIC void usbSetInterrupt3(uchar *data, uchar len);
 #define usbInterruptIsReady3()   (usbTxLen3 & 0x10)
+#define usbInterruptBuffer3()   (usbTxBuf3 + 1)
+USB_PUBLIC void usbCommitInterrupt3(uchar len, uchar changed);
 /* Same as above for endpoint 3 */
 #endif
 #endif /* USB_CFG_HAVE_INTRIN_ENDPOINT */
@@ -657,6 +670,7 @@ at90s1200, attiny11, attiny12, attiny15, attiny28: these have no RAM
 typedef struct usbTxStatus{
     volatile uchar   len;
     uchar   buffer[USB_BUFSIZE];
+    uchar   crcLen;     /* data length + 1 if a valid CRC follows the data, else 0 */
 }usbTxStatus_t;
 
 extern usbTxStatus_t   usbTxStatus1, usbTxStatus3;